@@ -16,6 +16,18 @@ c = conn.cursor()
 c.execute("CREATE TABLE IF NOT EXISTS users(username TEXT PRIMARY KEY, password TEXT)")
 c.execute("CREATE TABLE IF NOT EXISTS files(mid INTEGER PRIMARY KEY ASC, name TEXT, path TEXT);")
 
+# change log used for incremental catalog sync, keep in sync with server.c
+c.executescript("""
+CREATE TABLE IF NOT EXISTS changes(version INTEGER PRIMARY KEY AUTOINCREMENT, mid INTEGER);
+CREATE TRIGGER IF NOT EXISTS files_insert AFTER INSERT ON files
+BEGIN INSERT INTO changes(mid) VALUES(new.mid); END;
+CREATE TRIGGER IF NOT EXISTS files_update AFTER UPDATE OF name, path ON files
+BEGIN INSERT INTO changes(mid) VALUES(new.mid); END;
+CREATE TRIGGER IF NOT EXISTS files_delete AFTER DELETE ON files
+BEGIN INSERT INTO changes(mid) VALUES(old.mid); END;
+INSERT INTO changes(mid) SELECT mid FROM files WHERE NOT EXISTS (SELECT 1 FROM changes);
+""")
+
 conn.commit()
 
 for path in paths:
@@ -0,0 +1,387 @@
+/* micro benchmarks for the smdp primitives and the server's hot paths
+
+   the server is compiled into this program (with its main renamed) so the
+   handlers run unmodified, talking to us over a socketpair and using an
+   in-memory database filled with a synthetic catalog */
+
+#define main server_main
+#include "server.c"
+#undef main
+
+#include <time.h>
+
+#define CATALOG_ROWS 10000
+#define BENCH_FILE "/tmp/smdp_bench.mp3"
+#define BENCH_FILE_SIZE (8 * 1024 * 1024)
+#define BENCH_SNAPSHOT "/tmp/smdp_bench.snap"
+
+int iterations = 100000;
+
+double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void report(const char* name, double elapsed_ns, long ops, double bytes){
+    printf("%-24s %10ld ops %12.1f ns/op", name, ops, elapsed_ns / ops);
+
+    if(bytes > 0){
+        printf(" %10.1f MB/s", bytes / (elapsed_ns / 1e9) / (1024 * 1024));
+    }
+
+    printf("\n");
+}
+
+/* forks a process that reads and throws away everything written to sock,
+   so the benchmarked side never blocks on a full socket buffer */
+int start_drain(int sock, int other){
+    /* don't let the child inherit (and print again) our buffered output */
+    fflush(stdout);
+
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        char drain[65536];
+
+        close(other);
+        while(read(sock, drain, sizeof(drain)) > 0);
+        exit(0);
+    }
+
+    close(sock);
+    return pid;
+}
+
+void stop_drain(int sock, int pid){
+    close(sock);
+    waitpid(pid, NULL, 0);
+}
+
+void make_catalog(){
+    char name[64];
+    char path[64];
+    sqlite3_stmt* stmt;
+    int i;
+
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    sqlite3_prepare_v2(db, "INSERT INTO files(name, path) VALUES(?, ?)", -1, &stmt, 0);
+
+    for(i=0;i<CATALOG_ROWS;i++){
+        snprintf(name, 64, "Artist %d - Track %d", i / 12, i % 12);
+        snprintf(path, 64, "music/artist%d/track%d.mp3", i / 12, i % 12);
+
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, path, -1, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "INSERT INTO users VALUES('bench', 'secret')", 0, 0, 0);
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
+void make_file(){
+    FILE* fp = fopen(BENCH_FILE, "wb");
+    int i;
+
+    if(fp == NULL){
+        error("Cannot create benchmark file");
+    }
+
+    for(i=0;i<BENCH_FILE_SIZE/1024;i++){
+        memset(buf, i, 1024);
+        fwrite(buf, 1, 1024, fp);
+    }
+
+    fclose(fp);
+}
+
+void bench_int(){
+    int sv[2];
+    int i;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+    double start = now_ns();
+
+    for(i=0;i<iterations;i++){
+        smdp_write_int(sv[0], i);
+        smdp_read_int(sv[1]);
+    }
+
+    report("int encode+decode", now_ns() - start, iterations, 4.0 * iterations);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void bench_str(){
+    int sv[2];
+    int i;
+    char str[] = "Artist 42 - Track 7 (Remastered)";
+    char in[256];
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+    double start = now_ns();
+
+    for(i=0;i<iterations;i++){
+        smdp_write_str(sv[0], str);
+        smdp_read_str(sv[1], in, 256);
+    }
+
+    report("str encode+decode", now_ns() - start, iterations, (4.0 + strlen(str)) * iterations);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void bench_list_callback(){
+    int sv[2];
+    int i;
+    char* row[3] = {"4242", "Artist 353 - Track 6", "music/artist353/track6.mp3"};
+    double row_bytes = 4 + 3 * 4 + strlen(row[0]) + strlen(row[1]) + strlen(row[2]);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int pid = start_drain(sv[1], sv[0]);
+
+    double start = now_ns();
+
+    for(i=0;i<iterations;i++){
+        list_callback(&sv[0], 3, row, NULL);
+    }
+
+    report("list_callback", now_ns() - start, iterations, row_bytes * iterations);
+
+    stop_drain(sv[0], pid);
+}
+
+void bench_list(){
+    int sv[2];
+    int i;
+    int lists = 20;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int pid = start_drain(sv[1], sv[0]);
+
+    double start = now_ns();
+
+    for(i=0;i<lists;i++){
+        do_list(sv[0]);
+    }
+
+    report("do_list (per row)", now_ns() - start, (long)lists * CATALOG_ROWS, 0);
+
+    stop_drain(sv[0], pid);
+}
+
+void bench_lookup(const char* name){
+    char path[256];
+    int64_t digest;
+    int i;
+
+    double start = now_ns();
+
+    for(i=0;i<iterations;i++){
+        lookup_file(1 + (i * 7919) % CATALOG_ROWS, path, &digest);
+    }
+
+    report(name, now_ns() - start, iterations, 0);
+}
+
+/* the same listing and lookups served from a snapshot of the catalog,
+   with checksums known so lookups never fall back to the database */
+void bench_snapshot(){
+    sqlite3_exec(db, "UPDATE files SET digest=mid", 0, 0, 0);
+
+    snapshot_file = BENCH_SNAPSHOT;
+
+    double start = now_ns();
+    export_snapshot(snapshot_file);
+    report("export_snapshot", now_ns() - start, 1, 0);
+
+    int sv[2];
+    int i;
+    int lists = 20;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int pid = start_drain(sv[1], sv[0]);
+
+    start = now_ns();
+
+    for(i=0;i<lists;i++){
+        do_list(sv[0]);
+    }
+
+    report("do_list snapshot (per row)", now_ns() - start, (long)lists * CATALOG_ROWS, 0);
+
+    stop_drain(sv[0], pid);
+
+    bench_lookup("lookup_file snapshot");
+
+    snapshot_close(&catalog);
+    snapshot_file = NULL;
+    unlink(BENCH_SNAPSHOT);
+}
+
+void bench_pass(){
+    int sv[2];
+    int i;
+    int logins = iterations / 10;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    strcpy(username, "bench");
+
+    double start = now_ns();
+
+    for(i=0;i<logins;i++){
+        smdp_write_str(sv[1], "secret");
+        do_pass(sv[0]);
+
+        if(smdp_read_int(sv[1]) != SMDP_ACCEPT){
+            fprintf(stderr, "Authentication failed\n");
+            exit(1);
+        }
+    }
+
+    report("do_pass", now_ns() - start, logins, 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void bench_crc32c(){
+    int i;
+    int rounds = 4096;
+    uint32_t crc = 0;
+
+    memset(buf, 0x5a, 1024);
+
+    double start = now_ns();
+
+    for(i=0;i<rounds;i++){
+        crc = smdp_crc32c(crc, buf, 1024);
+    }
+
+    report("crc32c (1KB)", now_ns() - start, rounds, 1024.0 * rounds);
+}
+
+/* walks a synthetic 128 kbps stream in pieces the size receive_file reads,
+   and the same amount of random data, which is all searching */
+void bench_mp3scan(){
+    int size = BENCH_FILE_SIZE;
+    unsigned char* data = malloc(size);
+    struct mp3scan scan;
+    int pos = 0, i, rounds = 8;
+
+    srand(42);
+
+    for(i=0;i<size;i++){
+        data[i] = rand();
+    }
+
+    /* mpeg 1 layer iii frames at 128 kbps and 44.1 khz, padded every third */
+    for(i=0;pos+418<=size;i++){
+        int padding = i % 3 == 0;
+
+        data[pos] = 0xFF;
+        data[pos+1] = 0xFB;
+        data[pos+2] = 0x90 | (padding << 1);
+        data[pos+3] = 0x44;
+
+        pos += 417 + padding;
+    }
+
+    const char* names[2] = {"mp3scan frames (8MB)", "mp3scan random (8MB)"};
+    int pass;
+
+    for(pass=0;pass<2;pass++){
+        double start = now_ns();
+
+        for(i=0;i<rounds;i++){
+            int offset;
+
+            mp3scan_init(&scan);
+
+            for(offset=0;offset<size;offset+=1024){
+                mp3scan_feed(&scan, data + offset, size - offset < 1024 ? size - offset : 1024);
+            }
+
+            mp3scan_finish(&scan);
+        }
+
+        report(names[pass], now_ns() - start, rounds, (double)size * rounds);
+
+        for(i=0;i<size;i++){
+            data[i] = rand();
+        }
+    }
+
+    free(data);
+}
+
+/* sends with a cached digest, as for files uploaded through the server,
+   and without one, as for files whose digest is computed on first send */
+void bench_send_file(){
+    int sv[2];
+    int i;
+    int sends = 32;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int pid = start_drain(sv[1], sv[0]);
+
+    double start = now_ns();
+
+    for(i=0;i<sends;i++){
+        send_file(sv[0], BENCH_FILE, 0, 0);
+    }
+
+    report("send_file (8MB)", now_ns() - start, sends, (double)BENCH_FILE_SIZE * sends);
+
+    start = now_ns();
+
+    for(i=0;i<sends;i++){
+        send_file(sv[0], BENCH_FILE, 0, -1);
+    }
+
+    report("send_file+crc (8MB)", now_ns() - start, sends, (double)BENCH_FILE_SIZE * sends);
+
+    stop_drain(sv[0], pid);
+    unlink(BENCH_FILE);
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        iterations = atoi(argv[1]);
+    }
+
+    stats_init();
+    access_init();
+
+    db_path = ":memory:";
+    open_db();
+    create_schema();
+    make_catalog();
+    make_file();
+
+    bench_int();
+    bench_str();
+    bench_list_callback();
+    bench_list();
+    bench_lookup("lookup_file sql");
+    bench_snapshot();
+    bench_pass();
+    bench_crc32c();
+    bench_mp3scan();
+    bench_send_file();
+
+    sqlite3_close(db);
+
+    return 0;
+}
@@ -5,160 +5,1975 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
+#include <dirent.h>
+#include <time.h>
 #include <histedit.h>
+#include <sqlite3.h>
 #include "smdp.h"
+#include "snapshot.h"
 
 #define DEFAULT_PORT 3535
 
+/* in megabytes */
+#define DEFAULT_CACHE_SIZE 256
+
+/* how many times we try again when the server says it's busy */
+#define MAX_RETRIES 10
+
+/* servers are checked on (and reconnected to if they went away)
+   every HEALTH_INTERVAL seconds */
+#define HEALTH_INTERVAL 5
+
+/* what a server is being waited on for */
+#define PENDING_CONNECT 1
+#define PENDING_GREETING 2
+#define PENDING_CHECK 3
+
+/* in milliseconds, so an unreachable server doesn't stall us for long */
+#define CONNECT_TIMEOUT_MS 1000
+
+/* in seconds, a server that doesn't answer for this long is given up on */
+#define IO_TIMEOUT 30
+
+#define MAX_SERVERS 16
+
+/* large files are fetched in parts of SEGMENT_SIZE bytes over several
+   connections, starting with FETCH_CONNECTIONS and adding more (up to
+   MAX_FETCH_CONNECTIONS) for as long as that makes things faster */
+#define SEGMENT_SIZE (1024 * 1024)
+#define FETCH_CONNECTIONS 2
+#define MAX_FETCH_CONNECTIONS 8
+
+/* how often progress is reported, in milliseconds and received bytes */
+#define FETCH_REPORT_MS 1000
+#define FETCH_REPORT_BYTES (64 * 1024)
+
+#define SEGMENT_PENDING 0
+#define SEGMENT_RUNNING 1
+#define SEGMENT_DONE 2
+#define SEGMENT_FAILED 3
+
 char buf[1024];
 char* line;
 
-int sockfd;
+/* connection to the server handling the current command */
+int sockfd;
+
+int verbose = 0;
+int port_no = DEFAULT_PORT;
+
+/* downloaded files are kept in the cache directory, indexed by media id.
+   a cache size of zero disables caching */
+char cache_dir[256] = "cache";
+long cache_size = DEFAULT_CACHE_SIZE * 1024L * 1024L;
+
+/* every server given on the command line (all serving the same catalog)
+   gets a connection of its own. each command goes to the least loaded one,
+   and moves on to another one if its server goes away in the middle.
+   servers connected through a unix socket pass downloads as open files */
+struct server{
+    char name[256];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    /* -1 when not connected, with a reconnect due at retry_at */
+    int sock;
+    time_t retry_at;
+
+    /* results of the last health check */
+    time_t checked;
+    double rtt_ms;
+    long transfers;
+
+    /* what we're waiting for from it (connecting, its greeting or the reply
+       to a check) and until when, it takes no commands in the meantime */
+    int pending;
+    double deadline;
+    double check_start;
+    int login_pending;
+
+    long requests;
+    int authenticated;
+};
+
+struct server servers[MAX_SERVERS];
+int server_count = 0;
+struct server* current = NULL;
+
+/* route by round trip time only, instead of load */
+int route_latency = 0;
+
+/* a part of a file being fetched */
+struct segment{
+    uint32_t offset;
+    uint32_t len;
+    uint32_t received;
+    int state;
+};
+
+/* a process fetching parts, it gets them one by one through cmd */
+struct fetcher{
+    int pid;
+    int cmd;
+    int segment;
+};
+
+/* sent by fetchers as a part comes in */
+struct segment_report{
+    int worker;
+    int segment;
+    uint32_t bytes;
+    int state;
+};
+
+/* kept to log in to servers we connect to later */
+char username[256];
+char password[256];
+int logged_in = 0;
+
+const struct option long_options[] = {
+    {"verbose", no_argument, 0, 'v'},
+    {"port", required_argument, 0, 'p'},
+    {"cache-dir", required_argument, 0, 'c'},
+    {"cache-size", required_argument, 0, 's'},
+    {"unix", required_argument, 0, 'u'},
+    {"route", required_argument, 0, 'r'},
+    {0, 0, 0, 0}
+};
+
+int running = 1;
+
+/* local mirror of the server's catalog, kept in the cache directory
+   and brought up to date incrementally with the sync command */
+sqlite3* catalog;
+
+/* the server's catalog snapshot (see snapshot.h), downloaded whole with the
+   snapshot command and mapped on first use. it also has file sizes and an
+   index of the names, for searching without the server */
+struct snapshot catalog_snapshot;
+
+/* when the server is too busy to handle a request, it tells us how long
+   to wait before trying again. returns 1 if that was the case, after waiting */
+int server_busy(int resp){
+    if(resp != SMDP_BUSY){
+        return 0;
+    }
+
+    int ms = smdp_read_int(sockfd);
+
+    printf("Server busy, retrying in %d ms\n", ms);
+    usleep(ms * 1000);
+
+    return 1;
+}
+
+/* resolves a server given as host, host:port or (with is_unix) a socket path */
+void add_server(char* name, int is_unix){
+    if(server_count == MAX_SERVERS){
+        fprintf(stderr, "Too many servers, ignoring %s\n", name);
+        return;
+    }
+
+    struct server* s = &servers[server_count];
+
+    memset(s, 0, sizeof(struct server));
+    strncpy(s->name, name, 255);
+    s->sock = -1;
+
+    if(is_unix){
+        struct sockaddr_un* addr = (struct sockaddr_un*) &s->addr;
+
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, name, sizeof(addr->sun_path) - 1);
+        s->addrlen = sizeof(struct sockaddr_un);
+    } else {
+        struct sockaddr_in* addr = (struct sockaddr_in*) &s->addr;
+        char host[256];
+        int port = port_no;
+
+        strncpy(host, name, 255);
+        host[255] = 0;
+
+        char* colon = strchr(host, ':');
+
+        if(colon != NULL){
+            *colon = 0;
+            port = atoi(colon + 1);
+        }
+
+        struct hostent* server = gethostbyname(host);
+
+        if(server == NULL){
+            printf("ERROR: No such host %s\n", host);
+            exit(0);
+        }
+
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        memcpy(&addr->sin_addr.s_addr, server->h_addr, server->h_length);
+        s->addrlen = sizeof(struct sockaddr_in);
+    }
+
+    server_count++;
+}
+
+/* a server that failed is left alone until the next health check */
+void server_down(struct server* s){
+    if(s->sock >= 0){
+        close(s->sock);
+        s->sock = -1;
+    }
+
+    s->pending = 0;
+    s->retry_at = time(NULL) + HEALTH_INTERVAL;
+}
+
+/* a server that went away might just be restarting, so try to reconnect
+   right away (once) before waiting for the next health check */
+void server_lost(struct server* s){
+    printf("Lost connection to %s\n", s->name);
+    server_down(s);
+    s->retry_at = 0;
+}
+
+/* connect, giving up after CONNECT_TIMEOUT_MS so a dead server doesn't stall us */
+int connect_timeout(int sock, struct sockaddr* addr, socklen_t addrlen){
+    int flags = fcntl(sock, F_GETFL, 0);
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    if(connect(sock, addr, addrlen) < 0){
+        if(errno != EINPROGRESS){
+            return -1;
+        }
+
+        fd_set writefds;
+        struct timeval tv;
+
+        FD_ZERO(&writefds);
+        FD_SET(sock, &writefds);
+        tv.tv_sec = CONNECT_TIMEOUT_MS / 1000;
+        tv.tv_usec = (CONNECT_TIMEOUT_MS % 1000) * 1000;
+
+        if(select(sock + 1, NULL, &writefds, NULL, &tv) <= 0){
+            return -1;
+        }
+
+        if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0){
+            return -1;
+        }
+    }
+
+    fcntl(sock, F_SETFL, flags);
+    return 0;
+}
+
+/* logs in to a server with the credentials given by the user,
+   returns 1 if accepted, 0 if not and -1 if the connection was lost */
+int authenticate(struct server* s){
+    jmp_buf recover;
+    jmp_buf* outer = smdp_recover;
+
+    if(setjmp(recover) != 0){
+        smdp_recover = outer;
+        server_down(s);
+        return -1;
+    }
+
+    smdp_recover = &recover;
+
+    smdp_write_int(s->sock, SMDP_USER);
+    smdp_write_str(s->sock, username);
+    smdp_write_int(s->sock, SMDP_PASS);
+    smdp_write_str(s->sock, password);
+
+    s->authenticated = smdp_read_int(s->sock) == SMDP_ACCEPT;
+
+    smdp_recover = outer;
+    return s->authenticated;
+}
+
+/* reads what the server starts every session with, accept or, if it's
+   turning us away, busy and how long to wait. returns 0 (with the server
+   left alone until then) if we're not welcome */
+int server_greeting(struct server* s){
+    uint32_t resp = 0;
+    uint32_t ms = 0;
+
+    /* read directly, a failure just means the server isn't usable */
+    if(read(s->sock, &resp, sizeof(resp)) == sizeof(resp) && resp == SMDP_ACCEPT){
+        return 1;
+    }
+
+    if(resp == SMDP_BUSY){
+        read(s->sock, &ms, sizeof(ms));
+
+        if(verbose){
+            printf("%s is busy\n", s->name);
+        }
+    }
+
+    server_down(s);
+
+    if(ms > 0){
+        s->retry_at = time(NULL) + (ms + 999) / 1000;
+    }
+
+    return 0;
+}
+
+/* sets the timeouts of a connected socket, a server that stops answering
+   is given up on eventually */
+void server_timeouts(int sock){
+    struct timeval tv;
+
+    tv.tv_sec = IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* opens the connection to a server without waiting for its greeting,
+   so the first request can go out along with the handshake */
+void open_server(struct server* s){
+    s->checked = time(NULL);
+    s->sock = socket(s->addr.ss_family, SOCK_STREAM, 0);
+
+    if(s->sock < 0){
+        error("Error creating socket");
+    }
+
+    if(connect_timeout(s->sock, (struct sockaddr*) &s->addr, s->addrlen) < 0){
+        if(verbose){
+            printf("Cannot connect to %s\n", s->name);
+        }
+
+        server_down(s);
+        return;
+    }
+
+    server_timeouts(s->sock);
+}
+
+double now_ms(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* asks a server for its statistics, the reply is read by poll_servers.
+   when logging in as well, that goes first and its answer comes first */
+void send_check(struct server* s, int login){
+    jmp_buf recover;
+    jmp_buf* outer = smdp_recover;
+
+    if(setjmp(recover) != 0){
+        smdp_recover = outer;
+        server_lost(s);
+        return;
+    }
+
+    smdp_recover = &recover;
+
+    if(login){
+        smdp_write_int(s->sock, SMDP_USER);
+        smdp_write_str(s->sock, username);
+        smdp_write_int(s->sock, SMDP_PASS);
+        smdp_write_str(s->sock, password);
+    }
+
+    smdp_write_int(s->sock, SMDP_STATS);
+
+    smdp_recover = outer;
+
+    s->login_pending = login;
+    s->check_start = now_ms();
+    s->deadline = s->check_start + IO_TIMEOUT * 1000.0;
+}
+
+/* starts connecting to a server without waiting for it */
+void start_connect(struct server* s){
+    s->checked = time(NULL);
+    s->sock = socket(s->addr.ss_family, SOCK_STREAM, 0);
+
+    if(s->sock < 0){
+        error("Error creating socket");
+    }
+
+    fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL, 0) | O_NONBLOCK);
+
+    if(connect(s->sock, (struct sockaddr*) &s->addr, s->addrlen) < 0 && errno != EINPROGRESS){
+        if(verbose){
+            printf("Cannot connect to %s\n", s->name);
+        }
+
+        server_down(s);
+        return;
+    }
+
+    s->pending = PENDING_CONNECT;
+    s->deadline = now_ms() + CONNECT_TIMEOUT_MS;
+}
+
+/* the connection is up, so log in (if the user already did) and check
+   on the server right away, along with waiting for its greeting */
+void server_connected(struct server* s){
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if(getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0){
+        if(verbose){
+            printf("Cannot connect to %s\n", s->name);
+        }
+
+        server_down(s);
+        return;
+    }
+
+    fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL, 0) & ~O_NONBLOCK);
+    server_timeouts(s->sock);
+
+    s->rtt_ms = 0;
+    s->authenticated = 0;
+    s->pending = PENDING_GREETING;
+
+    send_check(s, logged_in);
+}
+
+/* reads the reply to a health check: the answer to the login if there
+   was one, then the statistics, with the number of transfers going on */
+void read_check(struct server* s){
+    jmp_buf recover;
+    jmp_buf* outer = smdp_recover;
+    char name[256], value[256];
+
+    if(setjmp(recover) != 0){
+        smdp_recover = outer;
+        server_lost(s);
+        return;
+    }
+
+    smdp_recover = &recover;
+
+    if(s->login_pending){
+        s->authenticated = smdp_read_int(s->sock) == SMDP_ACCEPT;
+        s->login_pending = 0;
+    }
+
+    smdp_read_int(s->sock);
+
+    int rows = smdp_read_int(s->sock);
+    int i;
+
+    for(i=0;i<rows;i++){
+        smdp_read_int(s->sock);
+        smdp_read_str(s->sock, name, 256);
+        smdp_read_str(s->sock, value, 256);
+
+        if(strcmp(name, "transfers") == 0){
+            s->transfers = atol(value);
+        }
+    }
+
+    smdp_recover = outer;
+
+    double rtt = now_ms() - s->check_start;
+
+    /* smoothed like tcp does it */
+    s->rtt_ms = s->rtt_ms == 0 ? rtt : 0.875 * s->rtt_ms + 0.125 * rtt;
+    s->checked = time(NULL);
+    s->pending = 0;
+}
+
+/* moves along the servers we're waiting on, waiting up to wait_ms for
+   the first of them to make progress (not at all if zero). a server
+   whose replies are still on their way can't take commands, so nothing
+   here waits on a single server */
+void poll_servers(int wait_ms){
+    for(;;){
+        fd_set readfds, writefds;
+        struct timeval tv;
+        double now = now_ms();
+        int maxfd = -1;
+        int i;
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+
+        for(i=0;i<server_count;i++){
+            struct server* s = &servers[i];
+
+            if(s->sock < 0 || s->pending == 0){
+                continue;
+            }
+
+            if(now >= s->deadline){
+                if(verbose){
+                    printf("%s is not answering\n", s->name);
+                }
+
+                server_down(s);
+                continue;
+            }
+
+            FD_SET(s->sock, s->pending == PENDING_CONNECT ? &writefds : &readfds);
+            maxfd = s->sock > maxfd ? s->sock : maxfd;
+        }
+
+        if(maxfd < 0){
+            return;
+        }
+
+        tv.tv_sec = wait_ms / 1000;
+        tv.tv_usec = (wait_ms % 1000) * 1000;
+
+        if(select(maxfd + 1, &readfds, &writefds, NULL, &tv) <= 0){
+            return;
+        }
+
+        for(i=0;i<server_count;i++){
+            struct server* s = &servers[i];
+
+            if(s->sock < 0){
+                continue;
+            }
+
+            if(s->pending == PENDING_CONNECT && FD_ISSET(s->sock, &writefds)){
+                server_connected(s);
+            } else if(s->pending == PENDING_GREETING && FD_ISSET(s->sock, &readfds)){
+                if(server_greeting(s)){
+                    if(verbose){
+                        printf("Connected to %s\n", s->name);
+                    }
+
+                    s->pending = PENDING_CHECK;
+                }
+            } else if(s->pending == PENDING_CHECK && FD_ISSET(s->sock, &readfds)){
+                read_check(s);
+            }
+        }
+
+        /* whatever has arrived in the meantime is picked up right away */
+        wait_ms = 0;
+    }
+}
+
+int server_ready(struct server* s){
+    return s->sock >= 0 && s->pending == 0;
+}
+
+/* starts reconnecting to servers that went away and picks up the results
+   of earlier checks, without waiting for any of them */
+void check_servers(){
+    time_t now = time(NULL);
+    int i;
+
+    for(i=0;i<server_count;i++){
+        struct server* s = &servers[i];
+
+        if(s->sock < 0 && now >= s->retry_at){
+            start_connect(s);
+        }
+    }
+
+    poll_servers(0);
+}
+
+/* checks on the servers every HEALTH_INTERVAL seconds. done after
+   a command, so the replies are in by the time of the next one */
+void start_checks(){
+    time_t now = time(NULL);
+    int i;
+
+    for(i=0;i<server_count;i++){
+        struct server* s = &servers[i];
+
+        if(server_ready(s) && now - s->checked >= HEALTH_INTERVAL){
+            s->pending = PENDING_CHECK;
+            send_check(s, 0);
+        }
+    }
+}
+
+/* waits until a server can take commands, or none is left to wait for */
+void wait_servers(){
+    int i;
+
+    for(;;){
+        int waiting = 0;
+
+        for(i=0;i<server_count;i++){
+            if(server_ready(&servers[i])){
+                return;
+            }
+
+            waiting += servers[i].sock >= 0;
+        }
+
+        if(waiting == 0){
+            return;
+        }
+
+        poll_servers(100);
+    }
+}
+
+/* picks the server for the next request: the one with the fewest transfers
+   going on, then the one we sent the fewest requests to (so that downloads
+   spread out), then the closest one. or just the closest one when routing
+   by latency */
+struct server* pick_server(){
+    struct server* best = NULL;
+    int i;
+
+    for(i=0;i<server_count;i++){
+        struct server* s = &servers[i];
+
+        if(!server_ready(s)){
+            continue;
+        }
+
+        if(best == NULL){
+            best = s;
+        } else if(route_latency){
+            if(s->rtt_ms < best->rtt_ms){
+                best = s;
+            }
+        } else if(s->transfers != best->transfers){
+            if(s->transfers < best->transfers){
+                best = s;
+            }
+        } else if(s->requests != best->requests){
+            if(s->requests < best->requests){
+                best = s;
+            }
+        } else if(s->rtt_ms < best->rtt_ms){
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+void do_echo(){
+    fgets(buf, 1023, stdin);
+    smdp_write_int(sockfd, SMDP_ECHO);
+    smdp_write_str(sockfd, buf);
+
+    memset(buf, 0, 1024);
+    smdp_read_int(sockfd); // ignore type, assume to be echo
+    smdp_read_str(sockfd, buf, 1024);
+
+    printf("%s\n", buf);    
+}
+
+void do_list(){
+    smdp_write_int(sockfd, SMDP_LIST);
+
+    smdp_read_int(sockfd); // ignore type, assume to be list
+    int rows = smdp_read_int(sockfd);
+
+    int i;
+    for(i=0;i<rows;i++){
+        smdp_read_int(sockfd); // ignore type, assume to be row
+        
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s ", buf);
+        
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s ", buf);
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s\n", buf);
+    }
+}
+
+void catalog_error(char* msg){
+    fprintf(stderr, "%s: %s\n", msg, sqlite3_errmsg(catalog));
+    sqlite3_close(catalog);
+    catalog = NULL;
+}
+
+/* opens the catalog mirror on first use, returns 0 on failure */
+int open_catalog(){
+    char path[512];
+
+    if(catalog != NULL){
+        return 1;
+    }
+
+    mkdir(cache_dir, 0755);
+    snprintf(path, 512, "%s/catalog.db", cache_dir);
+
+    if(sqlite3_open(path, &catalog) != SQLITE_OK){
+        catalog_error("Cannot open catalog");
+        return 0;
+    }
+
+    char* schema = "CREATE TABLE IF NOT EXISTS files(mid INTEGER PRIMARY KEY ASC, name TEXT, path TEXT);"
+                   "CREATE TABLE IF NOT EXISTS meta(key TEXT PRIMARY KEY, value INTEGER);"
+                   "INSERT OR IGNORE INTO meta VALUES('version', 0);"
+                   "INSERT OR IGNORE INTO meta VALUES('server', '');";
+
+    if(sqlite3_exec(catalog, schema, 0, 0, 0) != SQLITE_OK){
+        catalog_error("Cannot create catalog");
+        return 0;
+    }
+
+    return 1;
+}
+
+uint32_t catalog_version(){
+    sqlite3_stmt* stmt;
+    uint32_t version = 0;
+
+    sqlite3_prepare_v2(catalog, "SELECT value FROM meta WHERE key='version'", -1, &stmt, 0);
+
+    if(sqlite3_step(stmt) == SQLITE_ROW){
+        version = sqlite3_column_int(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/* whether the local mirror was last synced with the given server.
+   every server numbers its changes on its own, so a version is only
+   good for the server it came from */
+int catalog_from(const char* name){
+    sqlite3_stmt* stmt;
+    int same = 0;
+
+    sqlite3_prepare_v2(catalog, "SELECT value FROM meta WHERE key='server'", -1, &stmt, 0);
+
+    if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL){
+        same = strcmp((const char*)sqlite3_column_text(stmt, 0), name) == 0;
+    }
+
+    sqlite3_finalize(stmt);
+    return same;
+}
+
+/* asks the server for the rows changed since our version
+   and applies them to the local mirror in a single transaction.
+   after syncing with another server the mirror is rebuilt from scratch */
+void do_sync(){
+    if(!open_catalog()){
+        return;
+    }
+
+    int full = !catalog_from(current->name);
+
+    smdp_write_int(sockfd, SMDP_SYNC);
+    smdp_write_int(sockfd, full ? 0 : catalog_version());
+
+    smdp_read_int(sockfd); // ignore type, assume to be sync
+    uint32_t version = smdp_read_int(sockfd);
+    int rows = smdp_read_int(sockfd);
+
+    sqlite3_stmt* upsert;
+    sqlite3_stmt* remove;
+
+    sqlite3_exec(catalog, "BEGIN", 0, 0, 0);
+
+    if(full){
+        sqlite3_exec(catalog, "DELETE FROM files", 0, 0, 0);
+    }
+
+    sqlite3_prepare_v2(catalog, "INSERT OR REPLACE INTO files VALUES(?, ?, ?)", -1, &upsert, 0);
+    sqlite3_prepare_v2(catalog, "DELETE FROM files WHERE mid=?", -1, &remove, 0);
+
+    /* if the connection goes away halfway, undo the rows applied so far
+       before passing the failure on, the catalog stays at the old version */
+    jmp_buf abort_sync;
+    jmp_buf* outer = smdp_recover;
+
+    if(setjmp(abort_sync)){
+        sqlite3_finalize(upsert);
+        sqlite3_finalize(remove);
+        sqlite3_exec(catalog, "ROLLBACK", 0, 0, 0);
+
+        smdp_recover = outer;
+
+        if(outer != NULL){
+            longjmp(*outer, 1);
+        }
+
+        fprintf(stderr, "Connection closed during sync\n");
+        return;
+    }
+
+    smdp_recover = &abort_sync;
+
+    char mid[32];
+    char name[1024];
+
+    int i;
+    for(i=0;i<rows;i++){
+        uint32_t type = smdp_read_int(sockfd);
+
+        memset(mid, 0, 32);
+        smdp_read_str(sockfd, mid, 32);
+
+        if(type == SMDP_REMOVED){
+            sqlite3_bind_int(remove, 1, atoi(mid));
+            sqlite3_step(remove);
+            sqlite3_reset(remove);
+            continue;
+        }
+
+        memset(name, 0, 1024);
+        smdp_read_str(sockfd, name, 1024);
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+
+        sqlite3_bind_int(upsert, 1, atoi(mid));
+        sqlite3_bind_text(upsert, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(upsert, 3, buf, -1, SQLITE_STATIC);
+        sqlite3_step(upsert);
+        sqlite3_reset(upsert);
+    }
+
+    smdp_recover = outer;
+
+    sqlite3_finalize(upsert);
+    sqlite3_finalize(remove);
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(catalog, "UPDATE meta SET value=? WHERE key='version'", -1, &stmt, 0);
+    sqlite3_bind_int(stmt, 1, version);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(catalog, "UPDATE meta SET value=? WHERE key='server'", -1, &stmt, 0);
+    sqlite3_bind_text(stmt, 1, current->name, -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    if(sqlite3_exec(catalog, "COMMIT", 0, 0, 0) != SQLITE_OK){
+        catalog_error("Cannot update catalog");
+        return;
+    }
+
+    printf("Catalog at version %u (%d changes)\n", version, rows);
+}
+
+/* lists the local mirror without talking to the server */
+void do_catalog(){
+    if(!open_catalog()){
+        return;
+    }
+
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(catalog, "SELECT mid, name, path FROM files", -1, &stmt, 0);
+
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        printf("%s %s %s\n", sqlite3_column_text(stmt, 0),
+            sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 2));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+void do_stats(){
+    smdp_write_int(sockfd, SMDP_STATS);
+
+    smdp_read_int(sockfd); // ignore type, assume to be stats
+    int rows = smdp_read_int(sockfd);
+
+    int i;
+    for(i=0;i<rows;i++){
+        smdp_read_int(sockfd); // ignore type, assume to be row
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s ", buf);
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s\n", buf);
+    }
+}
+
+/* the username is sent along with the password */
+void do_user(char* name){
+    strncpy(username, name, 255);
+}
+
+/* logs in to every server, and remembers the credentials
+   for the ones we connect to later */
+void do_pass(char* pass){
+    int accepted = 0, denied = 0;
+    int i;
+
+    strncpy(password, pass, 255);
+
+    for(i=0;i<server_count;i++){
+        /* servers we're still waiting on log in once they're back */
+        if(!server_ready(&servers[i])){
+            continue;
+        }
+
+        int res = authenticate(&servers[i]);
+
+        if(res == 1){
+            accepted++;
+        } else if(res == 0){
+            denied++;
+        }
+    }
+
+    logged_in = accepted > 0;
+
+    if(accepted > 0 && denied == 0){
+        printf("Successfully logged in\n");
+    } else if(accepted > 0){
+        printf("Logged in to %d of %d servers\n", accepted, accepted + denied);
+    } else {
+        printf("Invalid username/password\n");
+    }
+}
+
+/* reads a file from given path and sends it through the socket connection
+   by reading the file into the buffer */
+void send_file(const char* path){
+
+    if(verbose){
+        printf("Sending file %s\n", path);
+    }
+
+    uint32_t len;
+    struct stat st;
+
+    /* stat returns -1 when the given file does not exist */
+    if(stat(path, &st) < 0){
+        fprintf(stderr, "File not found: %s\n", path);
+        return;
+    }
+
+    /* send the file command and file size */
+    len = st.st_size;
+
+    smdp_write_int(sockfd, len);
+
+    /* open the file */
+    FILE* fp;
+
+    fp = fopen(path, "rb");
+    
+    uint32_t counter = 0;
+    uint32_t crc = 0;
+
+    /* read into the buffer and send part by part until end of file */
+    while(counter < len){
+        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
+        memset(buf, 0, 1024);
+        fread(buf, sizeof(char), to_read, fp);
+
+        int n = write(sockfd, buf, to_read);
+        
+        if(n < 0){
+            error("Error writing to socket");
+        }
+
+        crc = smdp_crc32c(crc, buf, to_read);
+        counter += to_read;
+    }
+
+    /* the checksum goes after the file so the server can verify it */
+    smdp_write_int(sockfd, crc);
+
+    fclose(fp);
+}
+
+/* receives a file and verifies it against the checksum that follows it,
+   returns 0 (and removes the file) if it was corrupted on the way */
+int receive_file(char* path){
+    FILE* fp;
+    uint32_t crc = 0;
+
+    /* the length first, so a connection lost before the transfer
+       doesn't leave an open file behind */
+    uint32_t len = smdp_read_int(sockfd);
+    uint32_t counter = 0;
+
+    fp = fopen(path, "wb");
+
+    if(fp == NULL){
+        error("Cannot create file");
+    }
+
+    /* read into the buffer and send part by part until end of file */
+    while(counter < len){
+        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
+        int n = read(sockfd, buf, to_read);
+
+        if(n < 0){
+            fclose(fp);
+            unlink(path);
+            smdp_fail("Error reading from socket");
+        } else if(n == 0){
+            fprintf(stderr, "Connection closed during transfer\n");
+            fclose(fp);
+            unlink(path);
+            smdp_closed();
+            exit(1);
+        }
+
+        /* read may return less than we asked for, only keep what we got */
+        fwrite(buf, sizeof(char), n, fp);
+        crc = smdp_crc32c(crc, buf, n);
+        
+        counter += n;
+    }
+
+    fclose(fp);
+
+    uint32_t digest = smdp_read_int(sockfd);
+
+    if(digest != crc){
+        fprintf(stderr, "Checksum mismatch for %s, discarding it\n", path);
+        unlink(path);
+        return 0;
+    }
+
+    return 1;
+}
+
+void snapshot_location(char* path){
+    snprintf(path, 512, "%s/catalog.snap", cache_dir);
+}
+
+/* downloads the server's snapshot next to the old one and replaces it
+   once it has arrived intact */
+void do_snapshot(){
+    char path[512];
+    char tmp[512];
+
+    mkdir(cache_dir, 0755);
+    snapshot_location(path);
+    snprintf(tmp, 512, "%s/catalog.snap.tmp", cache_dir);
+
+    smdp_write_int(sockfd, SMDP_SNAPSHOT);
+
+    if(smdp_read_int(sockfd) == SMDP_NOFILE){
+        printf("Server has no snapshot\n");
+        return;
+    }
+
+    if(!receive_file(tmp)){
+        return;
+    }
+
+    struct snapshot fresh;
+
+    if(!snapshot_open(&fresh, tmp)){
+        fprintf(stderr, "Invalid snapshot, discarding it\n");
+        unlink(tmp);
+        return;
+    }
+
+    printf("Snapshot of %u files at version %u\n", fresh.header->count, fresh.header->catalog_version);
+    snapshot_close(&fresh);
+
+    /* the old one stays mapped (and usable) until the next search */
+    rename(tmp, path);
+    snapshot_close(&catalog_snapshot);
+}
+
+/* lists the files whose names start with prefix (all of them without one)
+   in the order of their names, using the snapshot instead of the server */
+void do_search(char* prefix){
+    char path[512];
+
+    snapshot_location(path);
+
+    if(catalog_snapshot.base == NULL && !snapshot_open(&catalog_snapshot, path)){
+        printf("No snapshot, get one with the snapshot command\n");
+        return;
+    }
+
+    if(prefix == NULL){
+        prefix = "";
+    }
+
+    struct snapshot* snap = &catalog_snapshot;
+    size_t len = strlen(prefix);
+    uint32_t pos;
+
+    for(pos=snapshot_find_name(snap, prefix);pos<snap->header->count;pos++){
+        uint32_t row = snap->by_name[pos];
+        const char* name = snapshot_name(snap, row);
+
+        if(strncmp(name, prefix, len) != 0){
+            break;
+        }
+
+        printf("%u %s %u\n", snap->mids[row], name, snap->sizes[row]);
+    }
+}
+
+/* copies a file from the cache to the path requested by the user */
+void copy_file(const char* src, const char* dst){
+    FILE* in = fopen(src, "rb");
+    FILE* out = fopen(dst, "wb");
+
+    if(in == NULL || out == NULL){
+        fprintf(stderr, "Cannot copy %s to %s\n", src, dst);
+        if(in) fclose(in);
+        if(out) fclose(out);
+        return;
+    }
+
+    size_t n;
+    while((n = fread(buf, 1, 1024, in)) > 0){
+        fwrite(buf, 1, n, out);
+    }
+
+    fclose(in);
+    fclose(out);
+}
+
+/* each cached file is stored as <mid>.mp3 in the cache directory,
+   next to a <mid>.meta file holding the size and mtime of the file
+   on the server and the last time we used it (for lru eviction) */
+void cache_path(int mid, const char* ext, char* path){
+    snprintf(path, 512, "%s/%d.%s", cache_dir, mid, ext);
+}
+
+/* returns 1 and fills in the validators if there is a usable cached copy */
+int cache_lookup(int mid, uint32_t* size, uint32_t* mtime){
+    char path[512];
+    struct stat st;
+    unsigned long used;
+
+    cache_path(mid, "meta", path);
+    FILE* fp = fopen(path, "r");
+
+    if(fp == NULL){
+        return 0;
+    }
+
+    int n = fscanf(fp, "%u %u %lu", size, mtime, &used);
+    fclose(fp);
+
+    if(n != 3){
+        return 0;
+    }
+
+    /* the data file might have been removed or truncated behind our back */
+    cache_path(mid, "mp3", path);
+    if(stat(path, &st) < 0 || (uint32_t)st.st_size != *size){
+        return 0;
+    }
+
+    return 1;
+}
+
+void cache_write_meta(int mid, uint32_t size, uint32_t mtime){
+    char path[512];
+
+    cache_path(mid, "meta", path);
+    FILE* fp = fopen(path, "w");
+
+    if(fp == NULL){
+        return;
+    }
+
+    fprintf(fp, "%u %u %lu\n", size, mtime, (unsigned long)time(NULL));
+    fclose(fp);
+}
+
+/* removes least recently used entries until the cache fits its size limit,
+   never removing the entry with the given media id */
+void cache_evict(int keep){
+    DIR* dir = opendir(cache_dir);
+
+    if(dir == NULL){
+        return;
+    }
+
+    struct dirent* ent;
+    long total = 0;
+
+    for(;;){
+        long oldest_used = -1;
+        int oldest = -1;
+        int found = 0;
+
+        total = 0;
+        rewinddir(dir);
+
+        while((ent = readdir(dir)) != NULL){
+            int mid;
+            uint32_t size, mtime;
+            unsigned long used;
+            char path[512];
+
+            if(sscanf(ent->d_name, "%d.meta", &mid) != 1 || strstr(ent->d_name, ".meta") == NULL){
+                continue;
+            }
+
+            snprintf(path, 512, "%s/%s", cache_dir, ent->d_name);
+            FILE* fp = fopen(path, "r");
+            if(fp == NULL){
+                continue;
+            }
+
+            if(fscanf(fp, "%u %u %lu", &size, &mtime, &used) == 3){
+                total += size;
+                found++;
+
+                if(mid != keep && (oldest_used < 0 || (long)used < oldest_used)){
+                    oldest_used = used;
+                    oldest = mid;
+                }
+            }
+
+            fclose(fp);
+        }
+
+        if(total <= cache_size || oldest < 0){
+            break;
+        }
+
+        if(verbose){
+            printf("Evicting %d from cache\n", oldest);
+        }
+
+        char path[512];
+        cache_path(oldest, "meta", path);
+        unlink(path);
+        cache_path(oldest, "mp3", path);
+        unlink(path);
+    }
+
+    closedir(dir);
+}
+
+/* reads the mtime and the file that follows it into the cache,
+   then copies the cached file to the requested path */
+void receive_cached(int mid, char* path){
+    char data_path[512];
+    char part_path[512];
+
+    uint32_t mtime = smdp_read_int(sockfd);
+
+    /* the old entry is invalid from now on, and the new one
+       only becomes valid once it has been completely received */
+    cache_path(mid, "meta", data_path);
+    unlink(data_path);
+
+    cache_path(mid, "mp3", data_path);
+    cache_path(mid, "part", part_path);
+
+    if(!receive_file(part_path)){
+        return;
+    }
+
+    rename(part_path, data_path);
+
+    struct stat st;
+    if(stat(data_path, &st) == 0){
+        cache_write_meta(mid, st.st_size, mtime);
+    }
+
+    cache_evict(mid);
+
+    if(path != NULL){
+        copy_file(data_path, path);
+    }
+}
+
+/* on a local connection the server hands us an open descriptor of the file
+   instead of its contents, so we map it and write it out from there. there is
+   nothing to cache either, the file is already on this host */
+void do_download_fd(int mid, char* path){
+    int fd;
+
+    smdp_write_int(sockfd, SMDP_FILE_FD);
+    smdp_write_int(sockfd, mid);
+
+    int resp = smdp_read_fd(sockfd, &fd);
+
+    if(resp == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    } else if(resp == SMDP_NOFILE){
+        printf("No such file\n");
+        return;
+    }
+
+    uint32_t len = smdp_read_int(sockfd);
+    uint32_t digest = smdp_read_int(sockfd);
+
+    if(fd < 0){
+        fprintf(stderr, "No file descriptor received for %d\n", mid);
+        return;
+    }
+
+    void* data = NULL;
+
+    if(len > 0){
+        data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(data == MAP_FAILED){
+            perror("Cannot map file");
+            close(fd);
+            return;
+        }
+    }
+
+    uint32_t crc = smdp_crc32c(0, data, len);
+
+    if(crc != digest){
+        fprintf(stderr, "Checksum mismatch for %s, discarding it\n", path);
+    } else {
+        FILE* fp = fopen(path, "wb");
+
+        if(fp == NULL){
+            fprintf(stderr, "Cannot write %s\n", path);
+        } else {
+            fwrite(data, 1, len, fp);
+            fclose(fp);
+        }
+    }
+
+    if(data != NULL){
+        munmap(data, len);
+    }
+
+    close(fd);
+}
+
+void do_download(int mid, char* path){
+    uint32_t size = 0, mtime = 0;
+    int resp;
+    int attempt;
+
+    if(current->addr.ss_family == AF_UNIX){
+        do_download_fd(mid, path);
+        return;
+    }
+
+    for(attempt=0;;attempt++){
+        if(cache_size <= 0){
+            smdp_write_int(sockfd, SMDP_FILE);
+            smdp_write_int(sockfd, mid);
+        } else {
+            mkdir(cache_dir, 0755);
+
+            /* a conditional request with zeroed validators
+               just fetches the file along with its mtime */
+            if(!cache_lookup(mid, &size, &mtime)){
+                size = 0;
+                mtime = 0;
+            }
+
+            smdp_write_int(sockfd, SMDP_FILE_IF);
+            smdp_write_int(sockfd, mid);
+            smdp_write_int(sockfd, size);
+            smdp_write_int(sockfd, mtime);
+        }
+
+        resp = smdp_read_int(sockfd);
+
+        if(!server_busy(resp)){
+            break;
+        }
+
+        if(attempt == MAX_RETRIES){
+            printf("Server busy, giving up\n");
+            return;
+        }
+    }
+
+    if(resp == SMDP_DENY){
+        printf("Access denied\n");
+    } else if(resp == SMDP_NOFILE){
+        printf("No such file\n");
+    } else if(resp == SMDP_NOT_MODIFIED){
+        char data_path[512];
+
+        if(verbose){
+            printf("Using cached copy of %d\n", mid);
+        }
+
+        cache_write_meta(mid, size, mtime);
+        cache_path(mid, "mp3", data_path);
+        copy_file(data_path, path);
+    } else if(cache_size <= 0){
+        receive_file(path);
+    } else {
+        receive_cached(mid, path);
+    }
+}
+
+void do_random(char* path){
+    int resp;
+    int attempt;
+
+    for(attempt=0;;attempt++){
+        smdp_write_int(sockfd, SMDP_RANDOM);
+
+        /* the server sends the id of the file it picked first */
+        resp = smdp_read_int(sockfd);
+
+        if(!server_busy(resp)){
+            break;
+        }
+
+        if(attempt == MAX_RETRIES){
+            printf("Server busy, giving up\n");
+            return;
+        }
+    }
+
+    if(resp == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    } else if(resp == SMDP_NOFILE){
+        printf("No such file\n");
+        return;
+    }
+
+    int mid = resp;
+    resp = smdp_read_int(sockfd);
+
+    if(resp == SMDP_NOFILE){
+        printf("No such file\n");
+        return;
+    }
+
+    printf("Got file %d\n", mid);
+
+    if(cache_size <= 0){
+        /* skip the mtime, we have no use for it */
+        smdp_read_int(sockfd);
+        receive_file(path);
+    } else {
+        mkdir(cache_dir, 0755);
+        receive_cached(mid, path);
+    }
+}
+
+/* downloads several files with a single request into a directory,
+   each file is named after its media id */
+void do_bundle(char* dir, int* mids, int count){
+    int i;
+    int resp;
+    int attempt;
+
+    for(attempt=0;;attempt++){
+        smdp_write_int(sockfd, SMDP_BUNDLE);
+        smdp_write_int(sockfd, count);
+
+        for(i=0;i<count;i++){
+            smdp_write_int(sockfd, mids[i]);
+        }
+
+        resp = smdp_read_int(sockfd);
+
+        if(!server_busy(resp)){
+            break;
+        }
+
+        if(attempt == MAX_RETRIES){
+            printf("Server busy, giving up\n");
+            return;
+        }
+    }
+
+    if(resp == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    }
+
+    mkdir(dir, 0755);
+
+    int entries = smdp_read_int(sockfd);
+    int received = 0;
+
+    for(i=0;i<entries;i++){
+        char path[512];
+        int mid = smdp_read_int(sockfd);
+
+        if(smdp_read_int(sockfd) == SMDP_NOFILE){
+            printf("No such file %d\n", mid);
+            continue;
+        }
+
+        snprintf(path, 512, "%s/%d.mp3", dir, mid);
+
+        if(receive_file(path)){
+            received++;
+        }
+    }
+
+    printf("Received %d files\n", received);
+}
+
+/* a fetch process: connects to its own server, and fetches the parts the
+   parent hands it through cmd straight into the file at their offsets,
+   reporting how far it got through report */
+void fetch_worker(int id, struct server* s, int mid, int fd, int cmd, int report){
+    struct server conn = *s;
+    uint32_t job[3];
+
+    /* failures just end the process, the parent hands its part to another one */
+    smdp_recover = NULL;
+
+    conn.sock = -1;
+    open_server(&conn);
+
+    if(conn.sock < 0){
+        exit(1);
+    }
+
+    sockfd = conn.sock;
+
+    /* the login and the first request go out right away, the greeting
+       and the answer to the login are read along with its reply */
+    int greeted = 0;
+
+    if(logged_in){
+        smdp_write_int(sockfd, SMDP_USER);
+        smdp_write_str(sockfd, username);
+        smdp_write_int(sockfd, SMDP_PASS);
+        smdp_write_str(sockfd, password);
+    }
+
+    /* segment number, offset and length */
+    while(read(cmd, job, sizeof(job)) == sizeof(job)){
+        struct segment_report rep = {id, job[0], 0, SEGMENT_RUNNING};
+        int resp;
+        int attempt;
+
+        for(attempt=0;;attempt++){
+            smdp_write_int(sockfd, SMDP_RANGE);
+            smdp_write_int(sockfd, mid);
+            smdp_write_int(sockfd, job[1]);
+            smdp_write_int(sockfd, job[2]);
+
+            if(!greeted){
+                if(!server_greeting(&conn)){
+                    exit(1);
+                }
+
+                if(logged_in && smdp_read_int(sockfd) != SMDP_ACCEPT){
+                    exit(1);
+                }
+
+                greeted = 1;
+            }
+
+            resp = smdp_read_int(sockfd);
+
+            if(!server_busy(resp) || attempt == MAX_RETRIES){
+                break;
+            }
+        }
+
+        if(resp != SMDP_FILE){
+            exit(1);
+        }
+
+        smdp_read_int(sockfd); // size of the whole file, we know it already
+
+        uint32_t len = smdp_read_int(sockfd);
+        uint32_t counter = 0;
+        uint32_t reported = 0;
+        uint32_t crc = 0;
+
+        while(counter < len){
+            uint32_t to_read = (len-counter<1024)?(len-counter):1024;
+            int n = read(sockfd, buf, to_read);
+
+            if(n <= 0){
+                exit(1);
+            }
+
+            if(pwrite(fd, buf, n, (off_t)job[1] + counter) != n){
+                perror("Cannot write file");
+                exit(1);
+            }
+
+            crc = smdp_crc32c(crc, buf, n);
+            counter += n;
+
+            if(counter - reported >= FETCH_REPORT_BYTES){
+                rep.bytes = counter;
+                write(report, &rep, sizeof(rep));
+                reported = counter;
+            }
+        }
+
+        rep.bytes = counter;
+        rep.state = smdp_read_int(sockfd) == crc ? SEGMENT_DONE : SEGMENT_FAILED;
+        write(report, &rep, sizeof(rep));
+    }
+
+    smdp_write_int(sockfd, SMDP_CLOSE);
+    close(sockfd);
+    exit(0);
+}
+
+/* starts a fetch process in one of the fetcher slots,
+   each one on the next server in turn */
+int start_fetcher(struct fetcher* fetchers, int slot, int id, int mid, int fd, int report){
+    struct fetcher* f = &fetchers[slot];
+    struct server* s = NULL;
+    int cmd[2];
+    int i;
+
+    for(i=0;i<server_count;i++){
+        struct server* candidate = &servers[(id + i) % server_count];
+
+        if(server_ready(candidate)){
+            s = candidate;
+            break;
+        }
+    }
+
+    if(s == NULL || pipe(cmd) < 0){
+        return 0;
+    }
+
+    /* don't let the child inherit (and print again) our buffered output */
+    fflush(stdout);
+
+    int pid = fork();
+
+    if(pid < 0){
+        close(cmd[0]);
+        close(cmd[1]);
+        return 0;
+    }
+
+    if(pid == 0){
+        /* the other fetchers only see the end of their work
+           once every copy of their command pipe is closed */
+        for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+            if(fetchers[i].pid != 0){
+                close(fetchers[i].cmd);
+            }
+        }
+
+        close(cmd[1]);
+        fetch_worker(id, s, mid, fd, cmd[0], report);
+    }
+
+    close(cmd[0]);
+
+    f->pid = pid;
+    f->cmd = cmd[1];
+    f->segment = -1;
+
+    return 1;
+}
+
+void stop_fetcher(struct fetcher* f){
+    close(f->cmd);
+    f->pid = 0;
+    f->segment = -1;
+}
+
+/* downloads a large file in parts over several connections at once (spread
+   over the servers, if there are several), writing every part at its place
+   in the file. it starts with FETCH_CONNECTIONS connections and adds more
+   as long as that makes the download faster */
+void do_fetch(int mid, char* path){
+    int resp;
+    int attempt;
+
+    /* a zero length part tells us how large the file is */
+    for(attempt=0;;attempt++){
+        smdp_write_int(sockfd, SMDP_RANGE);
+        smdp_write_int(sockfd, mid);
+        smdp_write_int(sockfd, 0);
+        smdp_write_int(sockfd, 0);
+
+        resp = smdp_read_int(sockfd);
+
+        if(!server_busy(resp)){
+            break;
+        }
+
+        if(attempt == MAX_RETRIES){
+            printf("Server busy, giving up\n");
+            return;
+        }
+    }
+
+    if(resp == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    } else if(resp == SMDP_NOFILE){
+        printf("No such file\n");
+        return;
+    }
+
+    uint32_t size = smdp_read_int(sockfd);
+
+    /* the empty part itself */
+    smdp_read_int(sockfd);
+    smdp_read_int(sockfd);
+
+    /* not worth the extra connections */
+    if(size <= SEGMENT_SIZE){
+        do_download(mid, path);
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0){
+        fprintf(stderr, "Cannot write %s\n", path);
+        return;
+    }
+
+    /* the parts arrive in any order, so make room for all of them up front */
+    if(size > 0 && posix_fallocate(fd, 0, size) != 0){
+        ftruncate(fd, size);
+    }
+
+    int count = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    struct segment* segments = calloc(count + 1, sizeof(struct segment));
+    struct fetcher fetchers[MAX_FETCH_CONNECTIONS];
+    int report[2];
+    int i;
+
+    for(i=0;i<count;i++){
+        segments[i].offset = (uint32_t)i * SEGMENT_SIZE;
+        segments[i].len = (size - segments[i].offset < SEGMENT_SIZE) ? size - segments[i].offset : SEGMENT_SIZE;
+        segments[i].state = SEGMENT_PENDING;
+    }
 
-int verbose = 0;
-int port_no = DEFAULT_PORT;
+    memset(fetchers, 0, sizeof(fetchers));
 
-const struct option long_options[] = {
-    {"verbose", no_argument, 0, 'v'},
-    {"port", required_argument, 0, 'p'},
-    {0, 0, 0, 0}
-};
+    if(pipe(report) < 0){
+        error("Cannot create pipe");
+    }
 
-int running = 1;
+    int target = count < FETCH_CONNECTIONS ? count : FETCH_CONNECTIONS;
+    int growing = 1;
+    int done = 0;
+    int failures = 0;
+    int started = 0;
 
-void do_echo(){
-    fgets(buf, 1023, stdin);
-    smdp_write_int(sockfd, SMDP_ECHO);
-    smdp_write_str(sockfd, buf);
+    struct timeval start, last, now;
+    uint64_t received = 0, last_received = 0;
+    double last_rate = 0;
 
-    memset(buf, 0, 1024);
-    smdp_read_int(sockfd); // ignore type, assume to be echo
-    smdp_read_str(sockfd, buf, 1024);
+    gettimeofday(&start, NULL);
+    last = start;
 
-    printf("%s\n", buf);    
-}
+    while(done < count){
+        /* start fetchers up to the target */
+        int running = 0;
 
-void do_list(){
-    smdp_write_int(sockfd, SMDP_LIST);
+        for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+            if(fetchers[i].pid != 0){
+                running++;
+            }
+        }
 
-    smdp_read_int(sockfd); // ignore type, assume to be list
-    int rows = smdp_read_int(sockfd);
+        for(i=0;i<MAX_FETCH_CONNECTIONS && running < target;i++){
+            if(fetchers[i].pid == 0 && start_fetcher(fetchers, i, started, mid, fd, report[1])){
+                started++;
+                running++;
+            }
+        }
 
-    int i;
-    for(i=0;i<rows;i++){
-        smdp_read_int(sockfd); // ignore type, assume to be row
-        
-        memset(buf, 0, 1024);
-        smdp_read_str(sockfd, buf, 1024);
-        printf("%s ", buf);
-        
-        memset(buf, 0, 1024);
-        smdp_read_str(sockfd, buf, 1024);
-        printf("%s ", buf);
+        if(running == 0 || failures > MAX_RETRIES){
+            printf("Cannot fetch %s, no server to fetch it from\n", path);
+            break;
+        }
 
-        memset(buf, 0, 1024);
-        smdp_read_str(sockfd, buf, 1024);
-        printf("%s\n", buf);
-    }
-}
+        /* hand pending parts to idle fetchers */
+        int next = 0;
 
-void do_user(char* username){
-    smdp_write_int(sockfd, SMDP_USER);
-    smdp_write_str(sockfd, username);
-}
+        for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+            struct fetcher* f = &fetchers[i];
 
-void do_pass(char* password){
-    smdp_write_int(sockfd, SMDP_PASS);
-    smdp_write_str(sockfd, password);
+            if(f->pid == 0 || f->segment >= 0){
+                continue;
+            }
 
-    uint32_t type = smdp_read_int(sockfd);
+            while(next < count && segments[next].state != SEGMENT_PENDING){
+                next++;
+            }
 
-    if(type == SMDP_ACCEPT){
-        printf("Successfully logged in\n");
-    } else {
-        printf("Invalid username/password\n");
-    }
-}
+            if(next == count){
+                break;
+            }
 
-/* reads a file from given path and sends it through the socket connection
-   by reading the file into the buffer */
-void send_file(const char* path){
+            uint32_t job[3] = {next, segments[next].offset, segments[next].len};
 
-    if(verbose){
-        printf("Sending file %s\n", path);
-    }
+            if(write(f->cmd, job, sizeof(job)) != sizeof(job)){
+                stop_fetcher(f);
+                continue;
+            }
 
-    uint32_t len;
-    struct stat st;
+            f->segment = next;
+            segments[next].state = SEGMENT_RUNNING;
+            segments[next].received = 0;
+        }
 
-    /* stat returns -1 when the given file does not exist */
-    if(stat(path, &st) < 0){
-        fprintf(stderr, "File not found: %s\n", path);
-        return;
-    }
+        /* wait for progress, waking up for the periodic report */
+        fd_set readfds;
+        struct timeval tv;
+
+        FD_ZERO(&readfds);
+        FD_SET(report[0], &readfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+
+        if(select(report[0] + 1, &readfds, NULL, NULL, &tv) > 0){
+            struct segment_report rep;
+
+            if(read(report[0], &rep, sizeof(rep)) == sizeof(rep)){
+                struct segment* seg = &segments[rep.segment];
+
+                received += rep.bytes - seg->received;
+                seg->received = rep.bytes;
+
+                for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+                    if(fetchers[i].pid != 0 && fetchers[i].segment == rep.segment && rep.state != SEGMENT_RUNNING){
+                        fetchers[i].segment = -1;
+                    }
+                }
+
+                if(rep.state == SEGMENT_DONE && seg->state != SEGMENT_DONE){
+                    seg->state = SEGMENT_DONE;
+                    done++;
+                } else if(rep.state == SEGMENT_FAILED){
+                    printf("Segment %d failed its checksum, fetching it again\n", rep.segment + 1);
+                    received -= seg->received;
+                    seg->received = 0;
+                    seg->state = SEGMENT_PENDING;
+                    failures++;
+                }
+            }
+        }
 
-    /* send the file command and file size */
-    len = st.st_size;
+        /* fetchers that died leave their part to the others */
+        int pid;
 
-    smdp_write_int(sockfd, len);
+        while((pid = waitpid(-1, NULL, WNOHANG)) > 0){
+            for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+                struct fetcher* f = &fetchers[i];
 
-    /* open the file */
-    FILE* fp;
+                if(f->pid != pid){
+                    continue;
+                }
 
-    fp = fopen(path, "rb");
-    
-    uint32_t counter = 0;
+                if(f->segment >= 0 && segments[f->segment].state == SEGMENT_RUNNING){
+                    received -= segments[f->segment].received;
+                    segments[f->segment].received = 0;
+                    segments[f->segment].state = SEGMENT_PENDING;
+                }
 
-    /* read into the buffer and send part by part until end of file */
-    while(counter < len){
-        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
-        memset(buf, 0, 1024);
-        fread(buf, sizeof(char), to_read, fp);
+                stop_fetcher(f);
+                failures++;
+            }
+        }
 
-        int n = write(sockfd, buf, to_read);
-        
-        if(n < 0){
-            error("Error writing to socket");
+        gettimeofday(&now, NULL);
+
+        double elapsed = (now.tv_sec - last.tv_sec) * 1000.0 + (now.tv_usec - last.tv_usec) / 1000.0;
+
+        if(elapsed < FETCH_REPORT_MS || done == count){
+            continue;
         }
 
-        counter += to_read;
-    }
+        double rate = (received - last_received) / (elapsed / 1000.0) / (1024 * 1024);
 
-    fclose(fp);
-}
+        printf("%5.1f%% %6.2f MB/s, %d connections:", 100.0 * received / size, rate, running);
 
-void receive_file(char* path){
-    FILE* fp;
+        for(i=0;i<count;i++){
+            if(segments[i].state == SEGMENT_RUNNING){
+                printf(" [%d %3d%%]", i + 1, (int)(100.0 * segments[i].received / segments[i].len));
+            }
+        }
 
-    fp = fopen(path, "wb");
-    
-    uint32_t len = smdp_read_int(sockfd);
-    uint32_t counter = 0;
+        printf("\n");
 
-    /* read into the buffer and send part by part until end of file */
-    while(counter < len){
-        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
-        int n = read(sockfd, buf, to_read);
+        /* one more connection if the last one helped, as long as there's
+           enough left to spread over them */
+        if(growing && target < MAX_FETCH_CONNECTIONS && count - done > target){
+            if(last_rate == 0 || rate > last_rate * 1.1){
+                target++;
+            } else {
+                growing = 0;
+            }
+        }
 
-        if(n < 0){
-            error("Error reading from socket");
+        last_rate = rate;
+        last_received = received;
+        last = now;
+    }
+
+    /* fetchers exit when there's nothing more to hand them */
+    for(i=0;i<MAX_FETCH_CONNECTIONS;i++){
+        if(fetchers[i].pid != 0){
+            int pid = fetchers[i].pid;
+
+            stop_fetcher(&fetchers[i]);
+            waitpid(pid, NULL, 0);
         }
+    }
 
-        fwrite(buf, sizeof(char), to_read, fp);
-        
-        counter += to_read;
+    close(report[0]);
+    close(report[1]);
+    close(fd);
+
+    if(done < count){
+        unlink(path);
+    } else {
+        gettimeofday(&now, NULL);
+
+        double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+
+        printf("Received %u bytes in %d segments in %.2f s (%.2f MB/s)\n", size, count, elapsed,
+               size / (elapsed > 0 ? elapsed : 1) / (1024 * 1024));
     }
 
+    free(segments);
+}
+
+void do_playlist_create(char* name){
+    smdp_write_int(sockfd, SMDP_PLAYLIST_CREATE);
+    smdp_write_str(sockfd, name);
 
-    fclose(fp);
+    if(smdp_read_int(sockfd) == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    }
+
+    printf("Created playlist %d\n", smdp_read_int(sockfd));
 }
 
-void do_download(int mid, char* path){
-    smdp_write_int(sockfd, SMDP_FILE);
+void do_playlist_append(int pid, int mid){
+    smdp_write_int(sockfd, SMDP_PLAYLIST_APPEND);
+    smdp_write_int(sockfd, pid);
     smdp_write_int(sockfd, mid);
 
     int resp = smdp_read_int(sockfd);
@@ -167,21 +1982,100 @@ void do_download(int mid, char* path){
         printf("Access denied\n");
     } else if(resp == SMDP_NOFILE){
         printf("No such file\n");
-    } else {
-        receive_file(path);
     }
 }
 
-void do_random(char* path){
-    smdp_write_int(sockfd, SMDP_RANDOM);
+void do_playlist_get(int pid){
+    smdp_write_int(sockfd, SMDP_PLAYLIST_GET);
+    smdp_write_int(sockfd, pid);
+
+    if(smdp_read_int(sockfd) == SMDP_DENY){
+        printf("Access denied\n");
+        return;
+    }
+
+    int rows = smdp_read_int(sockfd);
+
+    int i;
+    for(i=0;i<rows;i++){
+        smdp_read_int(sockfd); // ignore type, assume to be row
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s ", buf);
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s ", buf);
+
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("%s\n", buf);
+    }
+}
+
+/* plays a playlist by fetching its tracks one after the other into a directory,
+   named by their position in the playlist and their media id */
+void do_play(int pid, char* dir){
+    smdp_write_int(sockfd, SMDP_PLAY);
+    smdp_write_int(sockfd, pid);
 
     int resp = smdp_read_int(sockfd);
+
     if(resp == SMDP_DENY){
         printf("Access denied\n");
+        return;
     } else if(resp == SMDP_NOFILE){
-        printf("No such file\n");
-    } else {
+        printf("No such playlist\n");
+        return;
+    }
+
+    int tracks = smdp_read_int(sockfd);
+    int pos;
+    int attempt = 0;
+
+    mkdir(dir, 0755);
+
+    for(pos=0;;pos++){
+        smdp_write_int(sockfd, SMDP_NEXT);
+
+        resp = smdp_read_int(sockfd);
+
+        /* the queue doesn't move when the server is busy, so ask again */
+        if(server_busy(resp)){
+            if(attempt++ == MAX_RETRIES){
+                printf("Server busy, giving up\n");
+                return;
+            }
+
+            pos--;
+            continue;
+        }
+
+        attempt = 0;
+
+        if(resp == SMDP_NOFILE){
+            break;
+        }
+
+        int mid = smdp_read_int(sockfd);
+        int next_mid = smdp_read_int(sockfd);
+        uint32_t next_len = smdp_read_int(sockfd);
+
+        if(smdp_read_int(sockfd) == SMDP_NOFILE){
+            printf("Track %d/%d (%d) is missing\n", pos + 1, tracks, mid);
+            continue;
+        }
+
+        char path[512];
+        snprintf(path, 512, "%s/%03d-%d.mp3", dir, pos + 1, mid);
         receive_file(path);
+
+        if(next_mid != 0){
+            printf("Track %d/%d (%d), next up %d (%u bytes)\n", pos + 1, tracks, mid, next_mid, next_len);
+        } else {
+            printf("Track %d/%d (%d)\n", pos + 1, tracks, mid);
+        }
     }
 }
 
@@ -194,9 +2088,23 @@ void do_upload(char* name, char* path){
         return;
     }
 
-    smdp_write_int(sockfd, SMDP_UPLOAD);
+    int res;
+    int attempt;
+
+    for(attempt=0;;attempt++){
+        smdp_write_int(sockfd, SMDP_UPLOAD);
+
+        res = smdp_read_int(sockfd);
+
+        if(!server_busy(res)){
+            break;
+        }
 
-    int res = smdp_read_int(sockfd);
+        if(attempt == MAX_RETRIES){
+            printf("Server busy, giving up\n");
+            return;
+        }
+    }
 
     if(res == SMDP_DENY){
         printf("Access denied\n");
@@ -206,47 +2114,53 @@ void do_upload(char* name, char* path){
     smdp_write_str(sockfd, name);
 
     send_file(path);
+
+    if(smdp_read_int(sockfd) == SMDP_REJECT){
+        memset(buf, 0, 1024);
+        smdp_read_str(sockfd, buf, 1024);
+        printf("Upload rejected: %s\n", buf);
+    }
 }
 
 void signal_handler(int sig){
-    smdp_write_int(sockfd, SMDP_CLOSE);
-    close(sockfd);
+    int i;
+
+    for(i=0;i<server_count;i++){
+        if(servers[i].sock >= 0){
+            smdp_write_int(servers[i].sock, SMDP_CLOSE);
+            close(servers[i].sock);
+        }
+    }
 }
 
-void setup(char* hostname){
+void setup(){
     signal(SIGINT, signal_handler);
     signal(SIGQUIT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGSEGV, signal_handler);
 
-    sockfd = 0;
+    /* a server going away shows up as a failed write we can recover from */
+    signal(SIGPIPE, SIG_IGN);
 
-    struct sockaddr_in server_addr;
-    struct hostent* server;
-
-    memset(&server_addr, 0, sizeof(server_addr));
     memset(buf, 0, 1024);
 
-    server = gethostbyname(hostname);
+    check_servers();
+    wait_servers();
 
-    if(server == NULL){
-        printf("ERROR: No such host\n");
-        exit(0);
-    }
+    if(pick_server() == NULL){
+        char path[512];
+        struct stat st;
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_no);
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+        /* with a snapshot around the catalog can still be browsed */
+        snapshot_location(path);
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd < 0){
-        error("Error creating socket");
-    }
+        if(stat(path, &st) < 0){
+            printf("ERROR: Server is not accepting connections\n");
+            exit(0);
+        }
 
-    if(connect(sockfd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0){
-        error("Error connecting to server");
+        printf("No server available, working offline\n");
     }
-
 }
 
 void parse_opts(int argc, char** argv){
@@ -255,7 +2169,7 @@ void parse_opts(int argc, char** argv){
     for(;;){
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "p:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "p:vc:s:u:r:", long_options, &option_index);
 
         if(c == -1) break;
 
@@ -269,6 +2183,22 @@ void parse_opts(int argc, char** argv){
             printf("Verbose mode\n");
             break;
 
+            case 'c':
+            strncpy(cache_dir, optarg, 255);
+            break;
+
+            case 's':
+            cache_size = atol(optarg) * 1024L * 1024L;
+            break;
+
+            case 'u':
+            add_server(optarg, 1);
+            break;
+
+            case 'r':
+            route_latency = strcmp(optarg, "latency") == 0;
+            break;
+
             default:
             abort();
         }
@@ -278,11 +2208,22 @@ void parse_opts(int argc, char** argv){
 void help_message(){
     printf("Commands: \n");
     printf("* list \n");
+    printf("* sync \n");
+    printf("* catalog \n");
+    printf("* snapshot \n");
+    printf("* search [prefix] \n");
+    printf("* stats \n");
     printf("* user <username> \n");
     printf("* pass <password> \n");
     printf("* download <mid> <filename> \n");
     printf("* random <filename>\n");
+    printf("* bundle <directory> <mid> [<mid> ...]\n");
+    printf("* fetch <mid> <filename>\n");
     printf("* upload <name> <path>\n");
+    printf("* playlist new <name>\n");
+    printf("* playlist add <pid> <mid>\n");
+    printf("* playlist show <pid>\n");
+    printf("* play <pid> <directory>\n");
     printf("* exit\n");
 }
 
@@ -293,6 +2234,16 @@ void do_command(char* command){
 
     if(strcmp(tok, "list")==0){
         do_list();
+    } else if(strcmp(tok, "sync")==0){
+        do_sync();
+    } else if(strcmp(tok, "catalog")==0){
+        do_catalog();
+    } else if(strcmp(tok, "snapshot")==0){
+        do_snapshot();
+    } else if(strcmp(tok, "search")==0){
+        do_search(strtok(NULL, "\n"));
+    } else if(strcmp(tok, "stats")==0){
+        do_stats();
     } else if(strcmp(tok, "user")==0){
         tok = strtok(NULL, " \n");
         do_user(tok);
@@ -304,6 +2255,21 @@ void do_command(char* command){
         int mid = atoi(tok);
         tok = strtok(NULL, " \n");
         do_download(mid, tok);
+    } else if(strcmp(tok, "fetch")==0){
+        tok = strtok(NULL, " \n");
+        int mid = atoi(tok);
+        tok = strtok(NULL, " \n");
+        do_fetch(mid, tok);
+    } else if(strcmp(tok, "bundle")==0){
+        int mids[SMDP_BUNDLE_MAX];
+        int count = 0;
+        char* dir = strtok(NULL, " \n");
+
+        while(count < SMDP_BUNDLE_MAX && (tok = strtok(NULL, " \n")) != NULL){
+            mids[count++] = atoi(tok);
+        }
+
+        do_bundle(dir, mids, count);
     } else if(strcmp(tok, "random")==0){
         tok = strtok(NULL, " \n");
         do_random(tok);
@@ -313,6 +2279,24 @@ void do_command(char* command){
         strcpy(name, tok);
         tok = strtok(NULL, " \n");
         do_upload(name, tok);
+    } else if(strcmp(tok, "playlist")==0){
+        tok = strtok(NULL, " \n");
+
+        if(tok != NULL && strcmp(tok, "new")==0){
+            do_playlist_create(strtok(NULL, "\n"));
+        } else if(tok != NULL && strcmp(tok, "add")==0){
+            int pid = atoi(strtok(NULL, " \n"));
+            do_playlist_append(pid, atoi(strtok(NULL, " \n")));
+        } else if(tok != NULL && strcmp(tok, "show")==0){
+            do_playlist_get(atoi(strtok(NULL, " \n")));
+        } else {
+            printf("Invalid playlist command\n");
+        }
+    } else if(strcmp(tok, "play")==0){
+        tok = strtok(NULL, " \n");
+        int pid = atoi(tok);
+        tok = strtok(NULL, " \n");
+        do_play(pid, tok);
     }else if(strcmp(tok, "exit")==0){
         running = 0;
     } else {
@@ -320,6 +2304,96 @@ void do_command(char* command){
     }
 }
 
+/* commands that only look at local files, and work without any server */
+int offline_command(char* command){
+    char word[16] = {0};
+
+    sscanf(command, "%15s", word);
+
+    return strcmp(word, "catalog")==0 || strcmp(word, "search")==0 || strcmp(word, "exit")==0;
+}
+
+/* commands that change something on the server can't be started over,
+   the server that went away may have done it already */
+int retry_safe(char* command){
+    char word[16] = {0};
+    char sub[16] = {0};
+
+    sscanf(command, "%15s %15s", word, sub);
+
+    if(strcmp(word, "upload")==0){
+        return 0;
+    }
+
+    return strcmp(word, "playlist")!=0 || strcmp(sub, "show")==0;
+}
+
+/* runs a command on the best server. if that server goes away in the middle,
+   a command that can safely be repeated starts over on the next best one */
+void run_command(char* command){
+    char copy[1024];
+    jmp_buf recover;
+    volatile int attempt;
+
+    if(offline_command(command)){
+        strncpy(copy, command, 1023);
+        copy[1023] = 0;
+        do_command(copy);
+        return;
+    }
+
+    for(attempt=0;attempt<=server_count;attempt++){
+        check_servers();
+
+        current = pick_server();
+
+        /* only wait on the servers when none can take the command */
+        if(current == NULL){
+            wait_servers();
+            current = pick_server();
+        }
+
+        if(current == NULL){
+            printf("No server available\n");
+            return;
+        }
+
+        /* a server that came back while we were waiting on it hasn't
+           seen the login yet */
+        if(logged_in && !current->authenticated && authenticate(current) < 0){
+            continue;
+        }
+
+        sockfd = current->sock;
+
+        if(verbose){
+            printf("Using %s\n", current->name);
+        }
+
+        /* do_command takes the command apart, so give it a fresh copy every time */
+        strncpy(copy, command, 1023);
+        copy[1023] = 0;
+
+        if(setjmp(recover) == 0){
+            smdp_recover = &recover;
+            do_command(copy);
+            smdp_recover = NULL;
+
+            current->requests++;
+            start_checks();
+            return;
+        }
+
+        smdp_recover = NULL;
+        server_lost(current);
+
+        if(!retry_safe(command)){
+            printf("Lost the connection to %s, the command may or may not have been done\n", current->name);
+            return;
+        }
+    }
+}
+
 char* prompt(EditLine* e) {
     return "> ";
 }
@@ -327,14 +2401,23 @@ char* prompt(EditLine* e) {
 int main(int argc, char** argv){
     parse_opts(argc, argv);
 
-    if(argc < 2){
-        printf("USAGE: client hostname\n");
+    int i;
+
+    for(i=optind;i<argc;i++){
+        add_server(argv[i], 0);
+    }
+
+    if(server_count == 0){
+        printf("USAGE: client hostname[:port] [hostname[:port] ...]\n");
+        printf("       client --unix socket\n");
         return 0;
     }
 
-    printf("%s\n", argv[optind]);
+    for(i=0;i<server_count;i++){
+        printf("%s\n", servers[i].name);
+    }
 
-    setup(argv[optind]);
+    setup();
 
     help_message();
 
@@ -357,7 +2440,7 @@ int main(int argc, char** argv){
     el_set(el, EL_HIST, history, hist);
 
     while(running && (line = (char*)el_gets(el, &linelen)) != NULL){
-        do_command(line);
+        run_command(line);
 
         if(linelen!=0){
             history(hist, &ev, H_ENTER, line);
@@ -368,9 +2451,16 @@ int main(int argc, char** argv){
     history_end(hist);
     el_end(el);
 
-    smdp_write_int(sockfd, SMDP_CLOSE);
+    if(catalog != NULL){
+        sqlite3_close(catalog);
+    }
 
-    close(sockfd);
+    for(i=0;i<server_count;i++){
+        if(servers[i].sock >= 0){
+            smdp_write_int(servers[i].sock, SMDP_CLOSE);
+            close(servers[i].sock);
+        }
+    }
 
     return 0;
 }
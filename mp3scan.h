@@ -0,0 +1,459 @@
+#ifndef _MP3SCAN_H
+#define _MP3SCAN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+/* walks the mpeg audio frames of a file as it is being received, fed one
+   piece at a time like the checksum, so nothing has to be read twice.
+
+   a frame starts with a four byte header (sync word, version, layer,
+   bitrate, sample rate...) which gives its length, so once the first frame
+   is found the scanner simply jumps from header to header. the sync word
+   is only searched for at the start and when the chain of frames breaks.
+   a frame only counts once the header right after it checks out too,
+   random data happens to contain something that looks like a header
+   every few kilobytes, but hardly ever two in a row.
+
+   the first frame of a vbr file is usually an information frame (xing,
+   info or vbri) with no audio in it, carrying the number of frames of the
+   file, which is used to tell whether the file is complete */
+
+/* longest possible frame (mpeg 2.5 layer ii at 160 kbps and 8 khz with padding) */
+#define MP3_MAX_FRAME 2881
+
+#define MP3_ID3_HEADER 10
+#define MP3_ID3V1_SIZE 128
+
+/* kinds of information frames */
+#define MP3_INFO_NONE 0
+#define MP3_INFO_XING 1
+#define MP3_INFO_VBRI 2
+
+struct mp3_frame{
+    uint32_t version;
+    uint32_t layer;
+    uint32_t bitrate;
+    uint32_t sample_rate;
+    uint32_t samples;
+    uint32_t length;
+    uint32_t mono;
+};
+
+struct mp3scan{
+    /* the header being collected, and how much of it we have */
+    unsigned char head[MP3_ID3_HEADER];
+    int head_len;
+
+    /* still looking at the first bytes, which may be an id3v2 tag */
+    int at_start;
+
+    /* bytes left of the frame or tag being skipped over */
+    uint32_t skip;
+
+    /* in a chain of frames, or at a frame found by searching
+       that the next header has yet to confirm */
+    int locked;
+    int pending;
+    struct mp3_frame chain;
+
+    /* the first frame of a chain is kept to look for an information frame in,
+       which is only believed once the chain is confirmed */
+    unsigned char first[MP3_MAX_FRAME];
+    uint32_t first_len;
+    int capturing;
+    int first_checked;
+    int pending_info;
+    uint32_t pending_info_frames;
+
+    /* results */
+    uint32_t frames;
+    uint64_t samples;
+    uint32_t sample_rate;
+    uint32_t bitrate;
+    int vbr;
+    int info;
+    uint32_t info_frames;
+    int truncated;
+
+    uint64_t audio_bytes;
+    uint64_t tag_bytes;
+    uint64_t junk_bytes;
+};
+
+const uint16_t mp3_bitrates[2][3][16] = {
+    /* mpeg 1, layers i, ii and iii */
+    {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+     {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}},
+    /* mpeg 2 and 2.5 */
+    {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}}
+};
+
+/* indexed by the version bits: 2.5, reserved, 2 and 1 */
+const uint32_t mp3_sample_rates[4][3] = {
+    {11025, 12000, 8000},
+    {0, 0, 0},
+    {22050, 24000, 16000},
+    {44100, 48000, 32000}
+};
+
+/* decodes a frame header, returns 0 if it isn't one. free format frames
+   (no bitrate in the header) have no length we could jump by, so they
+   don't count as frames either */
+int mp3_parse_header(const unsigned char* h, struct mp3_frame* f){
+    if(h[0] != 0xFF || (h[1] & 0xE0) != 0xE0){
+        return 0;
+    }
+
+    uint32_t version = (h[1] >> 3) & 3;
+    uint32_t layer = 4 - ((h[1] >> 1) & 3);
+    uint32_t bitrate_index = h[2] >> 4;
+    uint32_t rate_index = (h[2] >> 2) & 3;
+    uint32_t padding = (h[2] >> 1) & 1;
+
+    if(version == 1 || layer == 4 || bitrate_index == 0 || bitrate_index == 15 ||
+       rate_index == 3 || (h[3] & 3) == 2){
+        return 0;
+    }
+
+    f->version = version;
+    f->layer = layer;
+    f->bitrate = mp3_bitrates[version == 3 ? 0 : 1][layer - 1][bitrate_index] * 1000;
+    f->sample_rate = mp3_sample_rates[version][rate_index];
+    f->mono = (h[3] >> 6) == 3;
+
+    if(layer == 1){
+        f->samples = 384;
+        f->length = (12 * f->bitrate / f->sample_rate + padding) * 4;
+    } else {
+        f->samples = (layer == 3 && version != 3) ? 576 : 1152;
+        f->length = f->samples / 8 * f->bitrate / f->sample_rate + padding;
+    }
+
+    return f->length > 4;
+}
+
+/* frames of one stream all have the same version, layer and sample rate */
+int mp3_same_stream(const struct mp3_frame* a, const struct mp3_frame* b){
+    return a->version == b->version && a->layer == b->layer && a->sample_rate == b->sample_rate;
+}
+
+uint32_t mp3_read_be(const unsigned char* p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* finds the first possible frame start in p: a 0xFF byte followed by
+   one with the top three bits set, or a 0xFF at the very end that
+   may be followed by one in the next piece. returns len if there's none */
+size_t mp3_find_sync_sw(const unsigned char* p, size_t len, size_t i){
+    for(;i<len;i++){
+        if(p[i] == 0xFF && (i + 1 == len || (p[i+1] & 0xE0) == 0xE0)){
+            return i;
+        }
+    }
+
+    return len;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* sse2 is part of x86-64, so this needs no check: compares sixteen positions
+   at once, the byte and the one after it, and only looks closer at a match */
+size_t mp3_find_sync(const unsigned char* p, size_t len){
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    const __m128i top = _mm_set1_epi8((char)0xE0);
+    size_t i = 0;
+
+    while(i + 17 <= len){
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 1));
+        __m128i sync = _mm_and_si128(_mm_cmpeq_epi8(a, ff),
+                                     _mm_cmpeq_epi8(_mm_and_si128(b, top), top));
+        int mask = _mm_movemask_epi8(sync);
+
+        if(mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+
+        i += 16;
+    }
+
+    return mp3_find_sync_sw(p, len, i);
+}
+#else
+size_t mp3_find_sync(const unsigned char* p, size_t len){
+    return mp3_find_sync_sw(p, len, 0);
+}
+#endif
+
+void mp3scan_init(struct mp3scan* s){
+    memset(s, 0, sizeof(struct mp3scan));
+    s->at_start = 1;
+}
+
+/* looks for an information frame in the captured first frame of a chain */
+void mp3scan_check_info(struct mp3scan* s){
+    const unsigned char* p = s->first;
+    struct mp3_frame f;
+
+    s->pending_info = MP3_INFO_NONE;
+    s->pending_info_frames = 0;
+
+    if(!mp3_parse_header(p, &f) || s->first_len < f.length){
+        return;
+    }
+
+    /* the xing tag follows the side information, whose size depends on
+       the version and the number of channels */
+    uint32_t xing = 4 + (f.version == 3 ? (f.mono ? 17 : 32) : (f.mono ? 9 : 17));
+
+    if(f.layer == 3 && xing + 8 <= f.length &&
+       (memcmp(p + xing, "Xing", 4) == 0 || memcmp(p + xing, "Info", 4) == 0)){
+        s->pending_info = MP3_INFO_XING;
+
+        /* the frame count is only there if the first flag is set */
+        if((mp3_read_be(p + xing + 4) & 1) && xing + 12 <= f.length){
+            s->pending_info_frames = mp3_read_be(p + xing + 8);
+        }
+    } else if(f.layer == 3 && 36 + 18 <= f.length && memcmp(p + 36, "VBRI", 4) == 0){
+        s->pending_info = MP3_INFO_VBRI;
+        s->pending_info_frames = mp3_read_be(p + 36 + 14);
+    }
+}
+
+void mp3scan_count(struct mp3scan* s, const struct mp3_frame* f){
+    if(s->frames > 0 && f->bitrate != s->bitrate){
+        s->vbr = 1;
+    }
+
+    if(s->frames == 0){
+        s->bitrate = f->bitrate;
+        s->sample_rate = f->sample_rate;
+    }
+
+    s->frames++;
+    s->samples += f->samples;
+    s->audio_bytes += f->length;
+}
+
+/* the header after a frame found by searching checked out,
+   so that frame really was one */
+void mp3scan_confirm(struct mp3scan* s){
+    s->pending = 0;
+    s->locked = 1;
+
+    /* an information frame only counts as such at the start of the file */
+    if(!s->first_checked && s->pending_info != MP3_INFO_NONE){
+        s->info = s->pending_info;
+        s->info_frames = s->pending_info_frames;
+        s->tag_bytes += s->chain.length;
+    } else {
+        mp3scan_count(s, &s->chain);
+    }
+
+    s->first_checked = 1;
+}
+
+/* the chain of frames is broken, a frame that was never confirmed is junk */
+void mp3scan_unlock(struct mp3scan* s){
+    if(s->pending){
+        s->junk_bytes += s->chain.length;
+    }
+
+    s->locked = 0;
+    s->pending = 0;
+}
+
+void mp3scan_feed(struct mp3scan* s, const void* data, size_t len);
+
+/* looks at a complete header */
+void mp3scan_header(struct mp3scan* s){
+    struct mp3_frame f;
+    int ok = mp3_parse_header(s->head, &f);
+
+    if((s->locked || s->pending) && (!ok || !mp3_same_stream(&f, &s->chain))){
+        mp3scan_unlock(s);
+    }
+
+    if(ok && (s->locked || s->pending)){
+        if(s->pending){
+            mp3scan_confirm(s);
+        }
+
+        mp3scan_count(s, &f);
+
+        s->chain = f;
+        s->head_len = 0;
+        s->skip = f.length - 4;
+        return;
+    }
+
+    if(ok){
+        /* a possible start of a chain, kept until the next header tells */
+        s->pending = 1;
+        s->chain = f;
+        s->head_len = 0;
+        s->skip = f.length - 4;
+
+        if(!s->first_checked){
+            memcpy(s->first, s->head, 4);
+            s->first_len = 4;
+            s->capturing = 1;
+        }
+
+        return;
+    }
+
+    /* an id3v1 tag at the end of the file */
+    if(memcmp(s->head, "TAG", 3) == 0){
+        s->tag_bytes += MP3_ID3V1_SIZE;
+        s->head_len = 0;
+        s->skip = MP3_ID3V1_SIZE - 4;
+        return;
+    }
+
+    /* not a header after all, search on from the byte after its start */
+    unsigned char rest[3];
+
+    memcpy(rest, s->head + 1, 3);
+    s->head_len = 0;
+    s->junk_bytes++;
+
+    mp3scan_feed(s, rest, 3);
+}
+
+void mp3scan_feed(struct mp3scan* s, const void* data, size_t len){
+    const unsigned char* p = data;
+    size_t pos = 0;
+
+    while(pos < len){
+        if(s->skip > 0){
+            size_t n = len - pos < s->skip ? len - pos : s->skip;
+
+            if(s->capturing){
+                memcpy(s->first + s->first_len, p + pos, n);
+                s->first_len += n;
+            }
+
+            s->skip -= n;
+            pos += n;
+
+            if(s->skip == 0 && s->capturing){
+                s->capturing = 0;
+                mp3scan_check_info(s);
+            }
+
+            continue;
+        }
+
+        /* an id3v2 tag can only come first, its header gives its size */
+        if(s->at_start){
+            while(s->head_len < MP3_ID3_HEADER && pos < len){
+                s->head[s->head_len++] = p[pos++];
+            }
+
+            if(s->head_len < MP3_ID3_HEADER){
+                break;
+            }
+
+            s->at_start = 0;
+
+            if(memcmp(s->head, "ID3", 3) == 0){
+                /* the size is stored seven bits per byte, plus a footer if flagged */
+                uint32_t size = ((s->head[6] & 0x7F) << 21) | ((s->head[7] & 0x7F) << 14) |
+                                ((s->head[8] & 0x7F) << 7) | (s->head[9] & 0x7F);
+
+                if(s->head[5] & 0x10){
+                    size += MP3_ID3_HEADER;
+                }
+
+                s->tag_bytes += MP3_ID3_HEADER + size;
+                s->head_len = 0;
+                s->skip = size;
+                continue;
+            }
+
+            /* no tag, go through these bytes again like any others */
+            unsigned char first[MP3_ID3_HEADER];
+            memcpy(first, s->head, MP3_ID3_HEADER);
+            s->head_len = 0;
+
+            mp3scan_feed(s, first, MP3_ID3_HEADER);
+            continue;
+        }
+
+        /* outside a chain, skip ahead to the next thing that looks like a header */
+        if(s->head_len == 0 && !s->locked && !s->pending){
+            size_t at = mp3_find_sync(p + pos, len - pos);
+
+            s->junk_bytes += at;
+            pos += at;
+
+            if(pos == len){
+                break;
+            }
+        }
+
+        while(s->head_len < 4 && pos < len){
+            s->head[s->head_len++] = p[pos++];
+        }
+
+        if(s->head_len == 4){
+            mp3scan_header(s);
+        }
+    }
+}
+
+/* wraps up after the last piece. a file that ends in the middle of a frame,
+   or with fewer frames than its information frame says, is truncated */
+void mp3scan_finish(struct mp3scan* s){
+    if(s->locked && s->skip > 0){
+        s->truncated = 1;
+    }
+
+    /* the last frame has no header after it to confirm it, but follows the chain */
+    if(s->pending && s->skip == 0 && s->first_checked){
+        mp3scan_confirm(s);
+    } else {
+        mp3scan_unlock(s);
+    }
+
+    s->junk_bytes += s->head_len;
+
+    /* encoders don't agree on whether the information frame counts itself */
+    if(s->info_frames > s->frames + 1){
+        s->truncated = 1;
+    }
+}
+
+/* what's wrong with the file, or NULL if it's a good mp3 file.
+   anything that is mostly not frames isn't one, even if it happens
+   to contain a few things that look like frames */
+const char* mp3scan_problem(const struct mp3scan* s){
+    if(s->frames == 0 || s->junk_bytes > s->audio_bytes){
+        return "not an mp3 file";
+    }
+
+    if(s->truncated){
+        return "truncated mp3 file";
+    }
+
+    return NULL;
+}
+
+/* duration in milliseconds */
+uint32_t mp3scan_duration(const struct mp3scan* s){
+    if(s->sample_rate == 0){
+        return 0;
+    }
+
+    return s->samples * 1000 / s->sample_rate;
+}
+
+#endif
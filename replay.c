@@ -0,0 +1,758 @@
+/* replays a trace captured by the server (with --capture) against a server,
+   with the same sessions, requests and pacing, and reports the latency
+   distribution of every request type next to the one in the trace.
+
+   each session of the trace gets its own process and connection, requests
+   are sent at the same offsets from the start of the trace as they were
+   captured, divided by the speed factor (zero sends them as fast as possible).
+   at most jobs sessions run at once, a session that has to wait for a free
+   slot starts late and catches up on its schedule.
+   responses are read in full but thrown away */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include "smdp.h"
+#include "trace.h"
+
+#define DEFAULT_PORT 3535
+
+/* how long to wait for the first sessions to be forked before starting the clock */
+#define START_DELAY_US 100000
+
+/* sessions replayed at the same time by default */
+#define DEFAULT_JOBS 64
+
+/* how often the parent checks for finished sessions while it waits for a slot */
+#define REAP_INTERVAL_US 10000
+
+char buf[1024];
+
+int verbose = 0;
+int port_no = DEFAULT_PORT;
+double speed = 1.0;
+int jobs = DEFAULT_JOBS;
+
+/* passwords aren't captured, this one is used for every login instead */
+char* password = "";
+
+struct sockaddr_in server_addr;
+
+const struct option long_options[] = {
+    {"verbose", no_argument, 0, 'v'},
+    {"port", required_argument, 0, 'p'},
+    {"speed", required_argument, 0, 's'},
+    {"password", required_argument, 0, 'w'},
+    {"jobs", required_argument, 0, 'j'},
+    {0, 0, 0, 0}
+};
+
+struct request{
+    struct trace_record rec;
+    unsigned char* args;
+};
+
+struct request* requests = NULL;
+int request_count = 0;
+uint32_t session_count = 0;
+
+/* the indexes of the requests grouped by session, in trace order within
+   each session. those of session s are session_requests[session_start[s]]
+   up to session_requests[session_start[s + 1]] */
+int* session_requests = NULL;
+int* session_start = NULL;
+
+/* sent from the session processes to the parent for every request replayed */
+struct sample{
+    uint32_t type;
+    uint32_t busy;
+    uint32_t captured_us;
+    uint32_t replayed_us;
+};
+
+const char* type_names[] = {
+    "echo", "list", "user", "pass", "accept", "deny", "row", "file",
+    "random", "nofile", "upload", "close", "file_if", "not_modified", "sync", "removed",
+    "stats", "bundle", "playlist_create", "playlist_append", "playlist_get", "play", "next", "reject",
+    "busy", "file_fd", "range", "snapshot"
+};
+
+#define TYPE_COUNT (sizeof(type_names) / sizeof(type_names[0]))
+
+uint64_t monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_until(uint64_t when){
+    uint64_t now = monotonic_us();
+
+    if(when > now){
+        usleep(when - now);
+    }
+}
+
+/* loads the whole trace into memory */
+void load_trace(const char* path){
+    FILE* fp = fopen(path, "rb");
+    struct trace_header header;
+    int capacity = 0;
+
+    if(fp == NULL){
+        error("Cannot open trace");
+    }
+
+    if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC){
+        fprintf(stderr, "%s is not a trace\n", path);
+        exit(1);
+    }
+
+    if(header.version != TRACE_VERSION){
+        fprintf(stderr, "Unsupported trace version %u\n", header.version);
+        exit(1);
+    }
+
+    for(;;){
+        struct trace_record rec;
+
+        if(fread(&rec, sizeof(rec), 1, fp) != 1){
+            break;
+        }
+
+        if(request_count == capacity){
+            capacity = capacity ? capacity * 2 : 1024;
+            requests = realloc(requests, capacity * sizeof(struct request));
+        }
+
+        requests[request_count].rec = rec;
+        requests[request_count].args = malloc(rec.arglen + 1);
+
+        if(fread(requests[request_count].args, 1, rec.arglen, fp) != rec.arglen){
+            fprintf(stderr, "Trace is truncated\n");
+            break;
+        }
+
+        if(rec.session > session_count){
+            session_count = rec.session;
+        }
+
+        request_count++;
+    }
+
+    fclose(fp);
+}
+
+/* groups the requests by session in one pass, a counting sort on the session */
+void group_sessions(){
+    int i;
+    uint32_t session;
+
+    session_start = calloc(session_count + 2, sizeof(int));
+    session_requests = malloc(request_count * sizeof(int));
+
+    for(i=0;i<request_count;i++){
+        session_start[requests[i].rec.session + 1]++;
+    }
+
+    for(session=1;session<=session_count+1;session++){
+        session_start[session] += session_start[session - 1];
+    }
+
+    /* session_start is used as the insertion point and ends up one
+       session ahead, shifting it back gives the starts again */
+    for(i=0;i<request_count;i++){
+        session_requests[session_start[requests[i].rec.session]++] = i;
+    }
+
+    for(session=session_count+1;session>0;session--){
+        session_start[session] = session_start[session - 1];
+    }
+
+    session_start[0] = 0;
+}
+
+int connect_server(){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(sock < 0){
+        error("Error creating socket");
+    }
+
+    if(connect(sock, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0){
+        error("Error connecting to server");
+    }
+
+    /* every session starts with accept, or busy if the server turns it away */
+    if(smdp_read_int(sock) != SMDP_ACCEPT){
+        fprintf(stderr, "Session turned away by the server\n");
+        exit(1);
+    }
+
+    return sock;
+}
+
+/* reads and throws away len bytes */
+void skip(int sock, uint32_t len){
+    while(len > 0){
+        int n = read(sock, buf, len < 1024 ? len : 1024);
+
+        if(n < 0){
+            error("Error reading from socket");
+        } else if(n == 0){
+            fprintf(stderr, "Connection closed by server\n");
+            exit(1);
+        }
+
+        len -= n;
+    }
+}
+
+void skip_str(int sock){
+    skip(sock, smdp_read_int(sock));
+}
+
+/* file size, contents and checksum */
+void skip_file(int sock){
+    skip(sock, smdp_read_int(sock));
+    smdp_read_int(sock);
+}
+
+/* rows of strings, as in list, sync, stats and playlist responses */
+void skip_rows(int sock, int columns){
+    int rows = smdp_read_int(sock);
+    int i, j;
+
+    for(i=0;i<rows;i++){
+        uint32_t type = smdp_read_int(sock);
+
+        /* removed rows in a sync response only have the media id */
+        int n = type == SMDP_REMOVED ? 1 : columns;
+
+        for(j=0;j<n;j++){
+            skip_str(sock);
+        }
+    }
+}
+
+/* the file data of uploads isn't captured, so about the same amount of silent
+   mp3 frames is sent instead (the server only takes mp3 files): a header
+   for mpeg 1 layer iii at 128 kbps and 44.1 khz with padding, then zeros */
+const unsigned char frame_header[4] = {0xFF, 0xFB, 0x92, 0x44};
+
+#define FRAME_SIZE 418
+
+int replay_upload(int sock, struct request* req){
+    uint32_t name_len, len;
+
+    if(req->rec.arglen < sizeof(uint32_t)){
+        return 0;
+    }
+
+    memcpy(&name_len, req->args, sizeof(name_len));
+
+    if(req->rec.arglen < 2 * sizeof(uint32_t) + name_len){
+        return 0;
+    }
+
+    memcpy(&len, req->args + sizeof(uint32_t) + name_len, sizeof(len));
+
+    /* whole frames only, or it would look truncated */
+    len -= len % FRAME_SIZE;
+
+    smdp_write_int(sock, SMDP_UPLOAD);
+
+    int resp = smdp_read_int(sock);
+
+    if(resp == SMDP_BUSY){
+        smdp_read_int(sock);
+        return 1;
+    } else if(resp != SMDP_ACCEPT){
+        return 0;
+    }
+
+    if(write(sock, req->args, sizeof(uint32_t) + name_len) < 0){
+        error("Error writing to socket");
+    }
+
+    smdp_write_int(sock, len);
+
+    uint32_t crc = 0;
+    uint32_t counter = 0;
+
+    while(counter < len){
+        uint32_t to_write = (len-counter<1024)?(len-counter):1024;
+        uint32_t i;
+
+        for(i=0;i<to_write;i++){
+            uint32_t pos = (counter + i) % FRAME_SIZE;
+            buf[i] = pos < 4 ? frame_header[pos] : 0;
+        }
+
+        if(write(sock, buf, to_write) < 0){
+            error("Error writing to socket");
+        }
+
+        crc = smdp_crc32c(crc, buf, to_write);
+        counter += to_write;
+    }
+
+    smdp_write_int(sock, crc);
+
+    if(smdp_read_int(sock) == SMDP_REJECT){
+        skip_str(sock);
+    }
+
+    return 0;
+}
+
+/* sends a request and reads its response, returns 1 if the server was busy */
+int replay_request(int sock, struct request* req){
+    uint32_t type = req->rec.type;
+
+    if(type == SMDP_UPLOAD){
+        return replay_upload(sock, req);
+    }
+
+    smdp_write_int(sock, type);
+
+    if(type == SMDP_PASS){
+        smdp_write_str(sock, password);
+    } else if(req->rec.arglen > 0 && write(sock, req->args, req->rec.arglen) < 0){
+        error("Error writing to socket");
+    }
+
+    /* user is the only request without a response */
+    if(type == SMDP_USER){
+        return 0;
+    }
+
+    uint32_t resp = smdp_read_int(sock);
+
+    if(resp == SMDP_BUSY){
+        smdp_read_int(sock);
+        return 1;
+    }
+
+    switch(type){
+        case SMDP_ECHO:
+        skip_str(sock);
+        break;
+
+        case SMDP_LIST:
+        case SMDP_PLAYLIST_GET:
+        if(resp == SMDP_LIST){
+            skip_rows(sock, 3);
+        }
+        break;
+
+        case SMDP_SYNC:
+        smdp_read_int(sock);
+        skip_rows(sock, 3);
+        break;
+
+        case SMDP_STATS:
+        skip_rows(sock, 2);
+        break;
+
+        case SMDP_FILE:
+        case SMDP_SNAPSHOT:
+        if(resp == SMDP_FILE){
+            skip_file(sock);
+        }
+        break;
+
+        case SMDP_FILE_FD:
+        /* the descriptor can't come over tcp, but the size and checksum do */
+        if(resp == SMDP_FILE_FD){
+            smdp_read_int(sock);
+            smdp_read_int(sock);
+        }
+        break;
+
+        case SMDP_RANGE:
+        if(resp == SMDP_FILE){
+            smdp_read_int(sock);
+            skip_file(sock);
+        }
+        break;
+
+        case SMDP_FILE_IF:
+        if(resp == SMDP_FILE){
+            smdp_read_int(sock);
+            skip_file(sock);
+        }
+        break;
+
+        case SMDP_RANDOM:
+        /* the response starts with the id of the file picked */
+        if(resp != SMDP_DENY && resp != SMDP_NOFILE && smdp_read_int(sock) == SMDP_FILE){
+            smdp_read_int(sock);
+            skip_file(sock);
+        }
+        break;
+
+        case SMDP_BUNDLE:
+        if(resp == SMDP_BUNDLE){
+            int entries = smdp_read_int(sock);
+            int i;
+
+            for(i=0;i<entries;i++){
+                smdp_read_int(sock);
+
+                if(smdp_read_int(sock) == SMDP_FILE){
+                    skip_file(sock);
+                }
+            }
+        }
+        break;
+
+        case SMDP_PLAYLIST_CREATE:
+        case SMDP_PLAY:
+        if(resp == SMDP_ACCEPT){
+            smdp_read_int(sock);
+        }
+        break;
+
+        case SMDP_NEXT:
+        if(resp == SMDP_NEXT){
+            /* media id and the header of the track after it */
+            smdp_read_int(sock);
+            smdp_read_int(sock);
+            smdp_read_int(sock);
+
+            if(smdp_read_int(sock) == SMDP_FILE){
+                skip_file(sock);
+            }
+        }
+        break;
+    }
+
+    return 0;
+}
+
+/* replays the requests of a session, reporting each one through the pipe */
+void replay_session(uint32_t session, uint64_t base, uint64_t trace_start, int out){
+    int sock = -1;
+    int i;
+
+    for(i=session_start[session];i<session_start[session + 1];i++){
+        struct request* req = &requests[session_requests[i]];
+
+        if(req->rec.type >= TYPE_COUNT || req->rec.type == SMDP_CLOSE){
+            continue;
+        }
+
+        if(speed > 0){
+            sleep_until(base + (req->rec.start_us - trace_start) / speed);
+        }
+
+        if(sock < 0){
+            sock = connect_server();
+        }
+
+        struct sample sample;
+        uint64_t start = monotonic_us();
+
+        sample.type = req->rec.type;
+        sample.busy = replay_request(sock, req);
+        sample.replayed_us = monotonic_us() - start;
+        sample.captured_us = req->rec.duration_us;
+
+        if(verbose){
+            printf("session %u: %s took %u us (captured %u us)\n", session,
+                   type_names[sample.type], sample.replayed_us, sample.captured_us);
+        }
+
+        if(write(out, &sample, sizeof(sample)) < 0){
+            error("Error writing samples");
+        }
+    }
+
+    if(sock >= 0){
+        smdp_write_int(sock, SMDP_CLOSE);
+        close(sock);
+    }
+}
+
+/* samples received from the sessions so far */
+struct sample* samples = NULL;
+int count = 0;
+int capacity = 0;
+
+/* sessions that didn't exit cleanly */
+int failed = 0;
+
+/* reads the samples waiting in the pipe, waiting up to timeout_us for them
+   (forever if negative). returns 0 once every session has closed the pipe */
+int collect_samples(int fd, int timeout_us){
+    struct sample sample;
+    fd_set readfds;
+    struct timeval tv;
+
+    for(;;){
+        FD_ZERO(&readfds);
+        FD_SET(fd, &readfds);
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+
+        if(select(fd + 1, &readfds, NULL, NULL, timeout_us < 0 ? NULL : &tv) <= 0){
+            return 1;
+        }
+
+        /* samples are written whole, well under the size pipes write atomically */
+        if(read(fd, &sample, sizeof(sample)) != sizeof(sample)){
+            return 0;
+        }
+
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 1024;
+            samples = realloc(samples, capacity * sizeof(struct sample));
+        }
+
+        samples[count++] = sample;
+
+        /* only wait for the first one */
+        timeout_us = 0;
+    }
+}
+
+/* collects the sessions that have ended, returns how many did */
+int reap_sessions(){
+    int status;
+    int reaped = 0;
+
+    while(waitpid(-1, &status, WNOHANG) > 0){
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            failed++;
+        }
+
+        reaped++;
+    }
+
+    return reaped;
+}
+
+int compare_us(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* percentile of a sorted array */
+uint32_t percentile(uint32_t* values, int count, double p){
+    if(count == 0){
+        return 0;
+    }
+
+    int i = p * (count - 1) + 0.5;
+    return values[i];
+}
+
+void report_type(const char* name, struct sample* samples, int count, int type){
+    uint32_t* captured = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t* replayed = malloc((count + 1) * sizeof(uint32_t));
+    int n = 0, busy = 0;
+    int i;
+
+    for(i=0;i<count;i++){
+        if(type >= 0 && samples[i].type != (uint32_t)type){
+            continue;
+        }
+
+        /* busy responses are counted, but don't say much about latency */
+        if(samples[i].busy){
+            busy++;
+            continue;
+        }
+
+        captured[n] = samples[i].captured_us;
+        replayed[n] = samples[i].replayed_us;
+        n++;
+    }
+
+    if(n + busy > 0){
+        qsort(captured, n, sizeof(uint32_t), compare_us);
+        qsort(replayed, n, sizeof(uint32_t), compare_us);
+
+        printf("%-16s %7d %6d %9u %9u %9u %9u %9u %9u\n", name, n, busy,
+               percentile(captured, n, 0.5), percentile(captured, n, 0.99),
+               percentile(replayed, n, 0.5), percentile(replayed, n, 0.9),
+               percentile(replayed, n, 0.99), n ? replayed[n - 1] : 0);
+    }
+
+    free(captured);
+    free(replayed);
+}
+
+void parse_opts(int argc, char** argv){
+    int c;
+
+    for(;;){
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "p:vs:w:j:", long_options, &option_index);
+
+        if(c == -1) break;
+
+        switch(c){
+            case 'p':
+            port_no = atoi(optarg);
+            break;
+
+            case 'v':
+            verbose = 1;
+            break;
+
+            case 's':
+            speed = atof(optarg);
+            break;
+
+            case 'w':
+            password = optarg;
+            break;
+
+            case 'j':
+            jobs = atoi(optarg);
+            break;
+
+            default:
+            abort();
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    parse_opts(argc, argv);
+
+    if(argc - optind < 2){
+        printf("USAGE: replay [--speed factor] [--password password] [--jobs sessions] hostname trace\n");
+        return 0;
+    }
+
+    struct hostent* server = gethostbyname(argv[optind]);
+
+    if(server == NULL){
+        printf("ERROR: No such host\n");
+        exit(0);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port_no);
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+
+    load_trace(argv[optind + 1]);
+
+    if(request_count == 0){
+        printf("Trace is empty\n");
+        return 0;
+    }
+
+    uint64_t trace_start = requests[0].rec.start_us;
+    int i;
+
+    for(i=1;i<request_count;i++){
+        if(requests[i].rec.start_us < trace_start){
+            trace_start = requests[i].rec.start_us;
+        }
+    }
+
+    if(jobs < 1){
+        jobs = 1;
+    }
+
+    group_sessions();
+
+    printf("Replaying %d requests in %u sessions\n", request_count, session_count);
+
+    /* a session turned away by the server shouldn't take the others down */
+    signal(SIGPIPE, SIG_IGN);
+
+    int fds[2];
+
+    if(pipe(fds) < 0){
+        error("Cannot create pipe");
+    }
+
+    uint64_t base = monotonic_us() + START_DELAY_US;
+    uint32_t session;
+    int running = 0;
+
+    fflush(stdout);
+
+    for(session=1;session<=session_count;session++){
+        if(session_start[session] == session_start[session + 1]){
+            continue;
+        }
+
+        /* keep the samples flowing while waiting for a session to end,
+           otherwise the running ones block on a full pipe */
+        while(running >= jobs){
+            collect_samples(fds[0], REAP_INTERVAL_US);
+            running -= reap_sessions();
+        }
+
+        int pid = fork();
+
+        if(pid < 0){
+            error("Error on fork");
+        }
+
+        if(pid == 0){
+            close(fds[0]);
+            replay_session(session, base, trace_start, fds[1]);
+            exit(0);
+        }
+
+        running++;
+    }
+
+    close(fds[1]);
+
+    /* collect the rest of the samples until every session is done */
+    while(collect_samples(fds[0], -1)){
+    }
+
+    int status;
+
+    while(wait(&status) > 0){
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            failed++;
+        }
+    }
+
+    double elapsed = (monotonic_us() - base) / 1e6;
+
+    printf("Replayed %d requests in %.2f s", count, elapsed);
+
+    if(failed > 0){
+        printf(", %d sessions ended early", failed);
+    }
+
+    printf("\n\n");
+    printf("%-16s %7s %6s %9s %9s %9s %9s %9s %9s\n", "request (us)", "count", "busy",
+           "trace p50", "trace p99", "p50", "p90", "p99", "max");
+
+    unsigned int type;
+
+    for(type=0;type<TYPE_COUNT;type++){
+        report_type(type_names[type], samples, count, type);
+    }
+
+    report_type("all", samples, count, -1);
+
+    return 0;
+}
@@ -1,16 +1,148 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <sqlite3.h>
 #include <getopt.h>
 #include "smdp.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "mp3scan.h"
 
 #define DEFAULT_PORT 3535
+#define DEFAULT_BACKLOG 5
+
+/* limits on concurrent sessions and transfers. connections over the session
+   limit wait in a queue of DEFAULT_QUEUE_LEN, and when that is full too they
+   are told to come back after DEFAULT_RETRY_AFTER milliseconds */
+#define DEFAULT_MAX_SESSIONS 256
+#define DEFAULT_MAX_TRANSFERS 128
+
+/* transfers whose holder is remembered when there is no limit on them */
+#define TRANSFER_HOLDERS 1024
+#define DEFAULT_QUEUE_LEN 128
+#define DEFAULT_RETRY_AFTER 200
+
+/* pre-forked workers exit (and are replaced) after this many sessions */
+#define DEFAULT_RECYCLE 1000
+
+/* how often the supervisor of the pre-forked workers looks after them */
+#define SUPERVISOR_TICK_MS 50
+
+/* how long a statement waits for a lock before giving up, in milliseconds */
+#define DEFAULT_BUSY_TIMEOUT 5000
+
+/* page cache size in kilobytes and memory mapped i/o size in bytes
+   for each database connection */
+#define DB_CACHE_KB 8192
+#define DB_MMAP_SIZE (256 * 1024 * 1024)
+
+/* uploads are registered by a background committer in batches of up to
+   INGEST_BATCH files, waiting at most INGEST_DELAY_MS for a batch to fill up */
+#define INGEST_BATCH 64
+#define INGEST_DELAY_MS 20
+
+/* seconds between attempts at registering a batch that failed */
+#define INGEST_RETRY_INTERVAL 1
+
+/* request counters per media id live in a shared hash table of ACCESS_SLOTS
+   entries, and halve every ACCESS_HALF_LIFE seconds so recent requests
+   weigh more. the committer saves them every ACCESS_FLUSH_INTERVAL seconds.
+   a media id only ever lives within ACCESS_PROBE slots of its hash, when
+   those are all taken the least requested one is handed over to it */
+#define ACCESS_SLOTS 8192
+#define ACCESS_PROBE 16
+#define ACCESS_HALF_LIFE (24 * 3600)
+#define ACCESS_FLUSH_INTERVAL 30
+
+/* the committer rewrites the catalog snapshot at most every
+   SNAPSHOT_MIN_INTERVAL seconds, however often the catalog changes */
+#define SNAPSHOT_MIN_INTERVAL 5
+
+/* how much of the next track of a play queue is read ahead of time */
+#define PREFETCH_BYTES (256 * 1024)
+
+/* number of most requested files read into the page cache at startup */
+#define DEFAULT_WARM_TRACKS 32
+
+/* files on storage tiers are looked at every MIGRATE_INTERVAL seconds and
+   at most MIGRATE_MAX_BYTES of them are moved each time. the old copy of
+   a moved file stays for MIGRATE_GRACE seconds for whoever still has its
+   old path. files already on a faster tier count MIGRATE_STAY_BONUS times
+   as popular, so two files about as popular don't keep trading places */
+#define MAX_TIERS 4
+#define MIGRATE_INTERVAL 60
+#define MIGRATE_MAX_BYTES (1024LL * 1024 * 1024)
+#define MIGRATE_GRACE 120
+#define MIGRATE_STAY_BONUS 1.5
+
+/* counters shared between all the server processes */
+#define STAT_DB_BUSY 0
+#define STAT_DB_BUSY_WAIT_US 1
+#define STAT_DB_BUSY_TIMEOUT 2
+#define STAT_INGEST_FILES 3
+#define STAT_INGEST_BATCHES 4
+#define STAT_SESSIONS 5
+#define STAT_TRANSFERS 6
+#define STAT_QUEUED 7
+#define STAT_SHED_SESSIONS 8
+#define STAT_SHED_TRANSFERS 9
+#define STAT_CAPTURED_SESSIONS 10
+#define STAT_CAPTURED_REQUESTS 11
+#define STAT_SNAPSHOTS 12
+#define STAT_REJECTED_UPLOADS 13
+#define STAT_MIGRATED_FILES 14
+#define STAT_MIGRATED_BYTES 15
+#define STAT_COUNT 16
+
+const char* stat_names[STAT_COUNT] = {
+    "db_busy",
+    "db_busy_wait_us",
+    "db_busy_timeout",
+    "ingest_files",
+    "ingest_batches",
+    "sessions",
+    "transfers",
+    "queued",
+    "shed_sessions",
+    "shed_transfers",
+    "captured_sessions",
+    "captured_requests",
+    "snapshots",
+    "rejected_uploads",
+    "migrated_files",
+    "migrated_bytes"
+};
+
+/* every insert, delete or rename in the files table is recorded in the changes
+   table by these triggers, and the version of the catalog is the id of the
+   latest change. rows that existed before the change log was introduced
+   are recorded once, so that syncing from version zero yields the whole catalog */
+#define CHANGES_SCHEMA \
+    "CREATE TABLE IF NOT EXISTS changes(version INTEGER PRIMARY KEY AUTOINCREMENT, mid INTEGER);" \
+    "CREATE TRIGGER IF NOT EXISTS files_insert AFTER INSERT ON files " \
+    "BEGIN INSERT INTO changes(mid) VALUES(new.mid); END;" \
+    "CREATE TRIGGER IF NOT EXISTS files_update AFTER UPDATE OF name, path ON files " \
+    "BEGIN INSERT INTO changes(mid) VALUES(new.mid); END;" \
+    "CREATE TRIGGER IF NOT EXISTS files_delete AFTER DELETE ON files " \
+    "BEGIN INSERT INTO changes(mid) VALUES(old.mid); END;" \
+    "INSERT INTO changes(mid) SELECT mid FROM files WHERE NOT EXISTS (SELECT 1 FROM changes);"
 
 char buf[1024];
 sqlite3* db;
@@ -19,15 +151,158 @@ char username[256];
 char password[256];
 int authenticated = 0;
 
+/* the playlist being played in this session, and the next track of it,
+   which is opened and read ahead while the current one is being sent */
+struct queued_track {
+    int mid;
+    FILE* fp;
+    uint32_t len;
+    int64_t digest;
+};
+
+int* play_queue = NULL;
+int play_queue_len = 0;
+int play_queue_pos = 0;
+struct queued_track prefetched;
+
 int listenfd;
 int connfd;
 
+/* optional unix domain socket for clients on the same host,
+   which can also get files as open descriptors */
+char* unix_path = NULL;
+int unixfd = -1;
+int local_session = 0;
+
+char* db_path = "server.db";
+
 int verbose = 0;
 int port_no = DEFAULT_PORT;
+int backlog = DEFAULT_BACKLOG;
+int busy_timeout = DEFAULT_BUSY_TIMEOUT;
+
+int max_sessions = DEFAULT_MAX_SESSIONS;
+int max_transfers = DEFAULT_MAX_TRANSFERS;
+int queue_len = DEFAULT_QUEUE_LEN;
+int retry_after = DEFAULT_RETRY_AFTER;
+
+/* whether this process is in the middle of a transfer */
+int transferring = 0;
+
+/* the pid holding each transfer slot, shared by all processes, so the slot
+   of a session that dies without giving it back (killed by a signal, say)
+   is released by whoever reaps it */
+pid_t* transfer_holders = NULL;
+int transfer_holder_count = 0;
+int transfer_holder = -1;
+
+int committer_pid = 0;
+
+/* storage tiers, fastest first, each a directory that can hold up to
+   capacity bytes (the last one has no limit). the migrator keeps the most
+   requested files under them on the fastest tiers that have room, files
+   anywhere else are left where they are */
+struct tier {
+    char dir[256];
+    uint64_t capacity;
+};
+
+struct tier tiers[MAX_TIERS];
+int tier_count = 0;
+int migrator_pid = 0;
+
+/* new uploads go to the slowest tier, if there are any,
+   and move up once they get popular */
+char* upload_dir = "uploads";
+
+/* when capturing, every request is appended to this trace file (see trace.h) */
+char* capture_path = NULL;
+int capture_fd = -1;
+uint32_t capture_session = 0;
+unsigned char capture_args[TRACE_ARGS_MAX + sizeof(uint32_t)];
+struct trace_record capture_rec;
+
+/* the catalog snapshot (see snapshot.h), mapped before forking so every
+   process shares the same pages. the committer writes a new one whenever
+   the catalog changes and counts it in the snapshots statistic, which is
+   how the other processes know to map the new one */
+char* snapshot_file = NULL;
+struct snapshot catalog;
+uint64_t catalog_generation = 0;
+
+/* with --export the snapshot is written to this file and the server exits */
+char* export_file = NULL;
+
+/* a completed upload waiting to be registered, small enough
+   to be written to the ingest pipe atomically (less than PIPE_BUF) */
+struct ingest_record {
+    char name[256];
+    char path[256];
+    uint32_t digest;
+    uint32_t duration;
+    uint32_t frames;
+};
+
+/* write end of the pipe to the committer. the read end stays open in the
+   main process too, so what's in the pipe survives a committer that dies
+   and is picked up by the one started in its place */
+int ingest_fd = -1;
+int ingest_read_fd = -1;
+
+/* an empty slot has a mid of zero, which sqlite never assigns */
+struct access_slot {
+    uint32_t mid;
+    uint32_t lock;
+    uint32_t updated;
+    uint32_t dirty;
+    double score;
+};
+
+struct access_slot* access_table;
+int warm_tracks = DEFAULT_WARM_TRACKS;
+
+/* lives in a shared mapping created before forking,
+   so every process updates the same counters */
+uint64_t* stats;
+
+/* number of acceptor processes, each with its own SO_REUSEPORT socket
+   so the kernel spreads new connections between them.
+   zero means one per core, and optionally each one is pinned to its core */
+int acceptors = 1;
+int pin_acceptors = 0;
+
+/* number of pre-forked workers, each accepting and handling connections
+   itself with its database already open. zero forks on every connection */
+int prefork = 0;
+int recycle_after = DEFAULT_RECYCLE;
+int prefork_worker = 0;
+int in_session = 0;
+
+/* whether each worker is in a session, shared with the supervisor so the
+   session of a worker that dies without leaving it (killed by a signal,
+   say) is still given back */
+int* worker_sessions = NULL;
+int worker_index = -1;
 
 const struct option long_options[] = {
     {"verbose", no_argument, 0, 'v'},
     {"port", required_argument, 0, 'p'},
+    {"backlog", required_argument, 0, 'b'},
+    {"acceptors", required_argument, 0, 'a'},
+    {"pin", no_argument, 0, 'P'},
+    {"busy-timeout", required_argument, 0, 'T'},
+    {"warm", required_argument, 0, 'w'},
+    {"max-sessions", required_argument, 0, 's'},
+    {"max-transfers", required_argument, 0, 't'},
+    {"queue", required_argument, 0, 'q'},
+    {"retry-after", required_argument, 0, 'r'},
+    {"capture", required_argument, 0, 'c'},
+    {"unix", required_argument, 0, 'u'},
+    {"prefork", required_argument, 0, 'f'},
+    {"recycle", required_argument, 0, 'R'},
+    {"snapshot", required_argument, 0, 'S'},
+    {"export", required_argument, 0, 'E'},
+    {"tier", required_argument, 0, 'i'},
     {0, 0, 0, 0}
 };
 
@@ -37,352 +312,2758 @@ void dberror(char* msg){
     exit(1);
 }
 
-void open_db(){
+void stats_init(){
+    stats = mmap(NULL, STAT_COUNT * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-    if(verbose){
-        printf("Opening db\n");
+    if(stats == MAP_FAILED){
+        error("Error mapping statistics");
     }
 
-    /* open a database connection and check for errors */
-    int rc;
+    /* there are never more holders than transfers, so with a limit
+       every transfer finds a place */
+    transfer_holder_count = max_transfers > 0 ? max_transfers : TRANSFER_HOLDERS;
+    transfer_holders = mmap(NULL, transfer_holder_count * sizeof(pid_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-    rc = sqlite3_open("server.db", &db);
-    if(rc != SQLITE_OK){
-        dberror("Cannot open database");
+    if(transfer_holders == MAP_FAILED){
+        error("Error mapping transfer slots");
     }
+}
 
-    /* create the tables if they don't exist */
-    char* schema = "CREATE TABLE IF NOT EXISTS users(username TEXT PRIMARY KEY, password TEXT);"
-                   "CREATE TABLE IF NOT EXISTS files(mid INTEGER PRIMARY KEY ASC, name TEXT, path TEXT);";
+void stat_add(int stat, uint64_t n){
+    __sync_fetch_and_add(&stats[stat], n);
+}
 
-    char* err_msg = NULL;
-    rc = sqlite3_exec(db, schema, 0, 0, &err_msg);
-    
-    if(rc != SQLITE_OK){
-        dberror(err_msg);
+void access_init(){
+    access_table = mmap(NULL, ACCESS_SLOTS * sizeof(struct access_slot), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-        sqlite3_free(err_msg);
+    if(access_table == MAP_FAILED){
+        error("Error mapping access counters");
     }
+}
 
-
-    if(verbose){
-        printf("db opened\n");
+/* the score of a slot as of the given time */
+double access_score(struct access_slot* slot, uint32_t now){
+    if(slot->updated > now){
+        return slot->score;
     }
 
-
+    return slot->score * exp2(-(double)(now - slot->updated) / ACCESS_HALF_LIFE);
 }
 
-void do_echo(int sock){
-    /* clear buffer and read a string */
-    memset(buf, 0, 1024);
-    smdp_read_str(sock, buf, 1024);
+void access_lock(struct access_slot* slot){
+    while(__sync_lock_test_and_set(&slot->lock, 1)){
+        sched_yield();
+    }
+}
 
-    /* write an echo command and write the string back */
-    smdp_write_int(sock, SMDP_ECHO);
-    smdp_write_str(sock, buf);
+void access_unlock(struct access_slot* slot){
+    __sync_lock_release(&slot->lock);
 }
 
-int list_callback(void* arg0, int argc, char** argv, char** colNames){
+/* finds the slot of a media id within its probe window, claiming an empty
+   one if it has none. slots are never emptied again, so an empty slot means
+   the id isn't further along. when the whole window is taken the slot with
+   the lowest score is given to the id instead, which forgets whatever the
+   old id gathered since the last flush, its saved row stays behind.
+   returns NULL if the slot was taken by someone else in the meantime */
+struct access_slot* access_slot(uint32_t mid, uint32_t now){
+    uint32_t h = (mid * 2654435761u) % ACCESS_SLOTS;
+    struct access_slot* victim = NULL;
+    double lowest = 0;
+    int i;
+
+    for(i=0;i<ACCESS_PROBE;i++){
+        struct access_slot* slot = &access_table[(h + i) % ACCESS_SLOTS];
+
+        if(slot->mid == mid || __sync_bool_compare_and_swap(&slot->mid, 0, mid) || slot->mid == mid){
+            return slot;
+        }
 
-    /* this callback is passed to sqlite3_exec as an argument
-       and socket handle is passed as an argument to it as well */
-    int sock = *(int*)arg0;
+        double score = access_score(slot, now);
 
-    if(argc < 3){
-        fprintf(stderr, "Too few columns returned, (shouldn't happen unless database is corrupt)");
-        exit(1);
+        if(victim == NULL || score < lowest){
+            victim = slot;
+            lowest = score;
+        }
     }
 
-    /* write the row command and three columns as strings (mid, name and path) */
-    smdp_write_int(sock, SMDP_ROW);
-    smdp_write_str(sock, argv[0]);
-    smdp_write_str(sock, argv[1]);
-    smdp_write_str(sock, argv[2]);
-
-    /* needs to return 0 for sqlite3_exec to continue with other rows */
-    return 0;
-}
+    uint32_t old = victim->mid;
 
-void do_list(int sock){
+    access_lock(victim);
 
-    if(verbose){
-        printf("Handling list operation\n");
+    if(victim->mid != old){
+        access_unlock(victim);
+        return victim->mid == mid ? victim : NULL;
     }
 
-    char* sql = "SELECT * FROM files";
-    char* csql = "SELECT COUNT(*) FROM files";
-    char* err_msg = NULL;
-    sqlite3_stmt* stmt;
-    int rc;
-
-    /* we need to find the number of rows to send */
-    rc = sqlite3_prepare_v2(db, csql, -1, &stmt, 0);
-    if(rc != SQLITE_OK){
-        dberror("Failed to fetch data");
-    }
+    victim->mid = mid;
+    victim->score = 0;
+    victim->updated = now;
+    victim->dirty = 0;
 
-    rc = sqlite3_step(stmt);
+    access_unlock(victim);
 
-    if(rc != SQLITE_ROW){
-        dberror("Failed to fetch data");
-    }
+    return victim;
+}
 
-    int len = sqlite3_column_int(stmt, 0);
+/* adds to the decayed score of a media id, the slots are shared between
+   processes so each one is protected by a tiny spinlock. the slot is looked
+   up again if it was handed over before the lock was taken */
+struct access_slot* access_add(uint32_t mid, double amount, uint32_t now){
+    int tries;
 
-    sqlite3_finalize(stmt);
+    for(tries=0;tries<3;tries++){
+        struct access_slot* slot = access_slot(mid, now);
 
-    /* send the command and number of rows */
-    smdp_write_int(sock, SMDP_LIST);
-    smdp_write_int(sock, len);
+        if(slot == NULL){
+            continue;
+        }
 
-    /* send the rows themselves (via list_callback function) */
-    rc = sqlite3_exec(db, sql, list_callback, &sock, &err_msg);
+        access_lock(slot);
 
-    if(rc != SQLITE_OK){
-        dberror(err_msg);
+        if(slot->mid != mid){
+            access_unlock(slot);
+            continue;
+        }
 
-        sqlite3_free(err_msg);
-    }
-}
+        if(slot->updated > now){
+            now = slot->updated;
+        }
 
-void do_user(int sock){
-    /* just read a string from socket and write it to username buffer
-       no authentication done here */
-    memset(username, 0, 256);
-    smdp_read_str(sock, username, 256);
+        slot->score = access_score(slot, now) + amount;
+        slot->updated = now;
+        slot->dirty = 1;
 
-    if(verbose){
-        printf("%s logging in\n", username);
-    }
-}
+        access_unlock(slot);
 
-void do_pass(int sock){
-    if(verbose){
-        printf("%s sent password\n", username);
+        return slot;
     }
 
-    /* read the password from socket connection into password buffer */
-    memset(password, 0, 256);  
-    smdp_read_str(sock, password, 256);
+    return NULL;
+}
 
-    /* fetch username and password from database */
-    char* sql = "SELECT * FROM users WHERE username = ?";
+void record_access(int mid){
+    access_add(mid, 1, time(NULL));
+}
 
+/* loads the saved counters into the shared table */
+void load_access(){
     sqlite3_stmt* stmt;
-    int rc;
 
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if(rc != SQLITE_OK){
-        dberror("Failed to execute statement");
+    if(sqlite3_prepare_v2(db, "SELECT mid, score, updated FROM access", -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to load access counters");
     }
 
-    sqlite3_bind_text(stmt, 1, username, strlen(username), SQLITE_STATIC);
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        uint32_t mid = sqlite3_column_int(stmt, 0);
 
-    rc = sqlite3_step(stmt);
+        struct access_slot* slot = access_add(mid, sqlite3_column_double(stmt, 1), sqlite3_column_int(stmt, 2));
 
+        /* already saved */
+        if(slot != NULL){
+            slot->dirty = 0;
+        }
+    }
 
-    if(rc == SQLITE_ROW){
-        /* a user with that username exists */
-        const char* realpass = (const char*)sqlite3_column_text(stmt, 1);
+    sqlite3_finalize(stmt);
+}
 
-        /* check if password matches 
-           (we really shouldn't be doing that - storing passwords in plaintext in db)
-           (but on the other hand, we really shouldn't be sending passwords 
-           in plaintext over network either) */
+/* writes the counters that changed since the last flush to the database */
+void flush_access(){
+    sqlite3_stmt* stmt;
+    int i;
+    int count = 0;
 
-        if(strcmp(password, realpass)==0){
-            authenticated = 1;
-        } else {
-            authenticated = 0;
-        }
-    } else {
-        /* no user with the specified username, deny authentication */
-        authenticated = 0;
+    sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+
+    if(sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO access VALUES(?, ?, ?)", -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to save access counters");
     }
 
-    /* inform the client if authentication was successful or not */
-    if(authenticated){
-        if(verbose){
-            printf("%s successfully logged in\n", username);
+    for(i=0;i<ACCESS_SLOTS;i++){
+        struct access_slot* slot = &access_table[i];
+
+        if(slot->mid == 0 || !slot->dirty){
+            continue;
         }
 
-        smdp_write_int(sock, SMDP_ACCEPT);
-    } else {
+        access_lock(slot);
 
-        if(verbose){
-            printf("Authentication failed for %s\n", username);
-        }
+        uint32_t mid = slot->mid;
+        double score = slot->score;
+        uint32_t updated = slot->updated;
+        slot->dirty = 0;
 
-        smdp_write_int(sock, SMDP_DENY);
+        access_unlock(slot);
+
+        sqlite3_bind_int(stmt, 1, mid);
+        sqlite3_bind_double(stmt, 2, score);
+        sqlite3_bind_int(stmt, 3, updated);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        count++;
     }
-}
 
-/* reads a file from given path and sends it through the socket connection
-   by reading the file into the buffer */
-void send_file(int sock, const char* path){
+    sqlite3_finalize(stmt);
 
-    if(verbose){
-        printf("Sending file %s\n", path);
+    if(sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+        dberror("Failed to save access counters");
     }
 
+    if(verbose && count > 0){
+        printf("Saved %d access counters\n", count);
+    }
+}
 
-    uint32_t len;
-    struct stat st;
+int compare_score(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
 
-    /* stat returns -1 when the given file does not exist */
-    if(stat(path, &st) < 0){
-        /* so in that case just send nofile, but that shouldn't happen
-           unless a non-existent path is in the database */
-        smdp_write_int(sock, SMDP_NOFILE);
-        fprintf(stderr, "File not found: %s\n", path);
+    return (x < y) - (x > y);
+}
+
+/* asks the kernel to read the most requested files into the page cache,
+   so popular files are not served cold right after a restart */
+void warm_cache(){
+    uint32_t now = time(NULL);
+    int i, n = 0;
+
+    if(warm_tracks <= 0){
         return;
     }
 
-    /* send the file command and file size */
-    len = st.st_size;
+    /* (score, mid) pairs sorted by descending score */
+    double* top = malloc(ACCESS_SLOTS * 2 * sizeof(double));
 
-    smdp_write_int(sock, SMDP_FILE);
-    smdp_write_int(sock, len);
+    for(i=0;i<ACCESS_SLOTS;i++){
+        if(access_table[i].mid != 0){
+            top[2*n] = access_score(&access_table[i], now);
+            top[2*n+1] = access_table[i].mid;
+            n++;
+        }
+    }
 
-    /* open the file */
-    FILE* fp;
+    qsort(top, n, 2 * sizeof(double), compare_score);
 
-    fp = fopen(path, "rb");
-    
-    uint32_t counter = 0;
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, "SELECT path FROM files WHERE mid=?", -1, &stmt, 0);
 
-    /* read into the buffer and send part by part until end of file */
-    while(counter < len){
-        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
-        memset(buf, 0, 1024);
-        fread(buf, sizeof(char), to_read, fp);
+    for(i=0;i<n && i<warm_tracks;i++){
+        sqlite3_bind_int(stmt, 1, (int)top[2*i+1]);
 
-        int n = write(sock, buf, to_read);
-        
-        if(n < 0){
-            error("Error writing to socket");
+        if(sqlite3_step(stmt) == SQLITE_ROW){
+            const char* path = (const char*)sqlite3_column_text(stmt, 0);
+            int fd = open(path, O_RDONLY);
+
+            if(fd >= 0){
+                if(verbose){
+                    printf("Warming %s\n", path);
+                }
+
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
         }
 
-        counter += to_read;
+        sqlite3_reset(stmt);
     }
 
-    fclose(fp);
+    sqlite3_finalize(stmt);
+    free(top);
 }
 
-void receive_file(int sock, char* path){
-    FILE* fp;
+/* takes one of the transfer slots shared by all processes, or tells the
+   client to retry later if they are all taken */
+int begin_transfer(int sock){
+    for(;;){
+        uint64_t current = stats[STAT_TRANSFERS];
 
-    fp = fopen(path, "wb");
-    
-    uint32_t len = smdp_read_int(sock);
-    if(verbose){
-        printf("received length %d\n", len);
-    }
-    uint32_t counter = 0;
+        if(max_transfers > 0 && current >= (uint64_t)max_transfers){
+            stat_add(STAT_SHED_TRANSFERS, 1);
 
-    /* read into the buffer and send part by part until end of file */
-    while(counter < len){
-        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
-        int n = read(sock, buf, to_read);
+            if(verbose){
+                printf("Too many transfers, asking client to retry\n");
+            }
 
-        if(n < 0){
-            error("Error reading from socket");
+            smdp_write_int(sock, SMDP_BUSY);
+            smdp_write_int(sock, retry_after);
+            return 0;
         }
 
-        fwrite(buf, sizeof(char), to_read, fp);
-        
-        counter += to_read;
+        if(__sync_bool_compare_and_swap(&stats[STAT_TRANSFERS], current, current + 1)){
+            int i;
+
+            for(i=0;i<transfer_holder_count;i++){
+                if(__sync_bool_compare_and_swap(&transfer_holders[i], 0, getpid())){
+                    transfer_holder = i;
+                    break;
+                }
+            }
+
+            transferring = 1;
+            return 1;
+        }
     }
+}
 
+void end_transfer(){
+    if(transferring){
+        if(transfer_holder >= 0){
+            transfer_holders[transfer_holder] = 0;
+            transfer_holder = -1;
+        }
 
-    fclose(fp);
+        __sync_fetch_and_sub(&stats[STAT_TRANSFERS], 1);
+        transferring = 0;
+    }
 }
 
-void do_file(int sock){
+/* gives back the transfer slot a process that has ended was still holding */
+void release_transfer(int pid){
+    int i;
 
-    int mid = smdp_read_int(sock);
+    for(i=0;i<transfer_holder_count;i++){
+        if(__sync_bool_compare_and_swap(&transfer_holders[i], pid, 0)){
+            __sync_fetch_and_sub(&stats[STAT_TRANSFERS], 1);
 
-    if(verbose){
-        printf("Handling file command for id %d\n", mid);
+            if(verbose){
+                printf("Released the transfer slot of %d\n", pid);
+            }
+        }
     }
+}
 
+/* called by sqlite when a table is locked by another process, instead of
+   failing right away we back off for a while and count the time spent waiting */
+int busy_handler(void* arg, int count){
+    /* 1, 2, 4, 8, 16 and then 25 milliseconds per retry */
+    static const int delays[] = {1, 2, 4, 8, 16, 25};
+    int waited = 0;
+    int i;
 
-    /* reject if the client isn't authenticated */
-    if(!authenticated){
-        smdp_write_int(sock, SMDP_DENY);
-        return;
+    for(i=0;i<count;i++){
+        waited += delays[i < 5 ? i : 5];
     }
 
-    /* get the requested media id from socket and fetch it from the database */
-    char* sql = "SELECT path FROM files WHERE mid=?";
-
-    sqlite3_stmt* stmt;
-    int rc;
+    if(count == 0){
+        stat_add(STAT_DB_BUSY, 1);
+    }
 
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if(rc != SQLITE_OK){
-        dberror("Failed to execute statement");
+    if(waited >= busy_timeout){
+        stat_add(STAT_DB_BUSY_TIMEOUT, 1);
+        return 0;
     }
 
-    sqlite3_bind_int(stmt, 1, mid);
+    int delay = delays[count < 5 ? count : 5];
+    usleep(delay * 1000);
+    stat_add(STAT_DB_BUSY_WAIT_US, delay * 1000);
 
-    rc = sqlite3_step(stmt);
+    return 1;
+}
 
-    if(rc == SQLITE_ROW){
-        /* found the file, send it */
-        const char* path = (const char*)sqlite3_column_text(stmt, 0);
-        send_file(sock, path);
-    } else {
+void open_db(){
+
+    if(verbose){
+        printf("Opening db\n");
+    }
+
+    /* open a database connection and check for errors */
+    int rc;
+
+    rc = sqlite3_open(db_path, &db);
+    if(rc != SQLITE_OK){
+        dberror("Cannot open database");
+    }
+
+    sqlite3_busy_handler(db, busy_handler, NULL);
+
+    /* in wal mode readers don't block the writer and the writer doesn't block
+       readers, so listings and lookups never wait for an upload to commit.
+       reads go through a memory mapping of the database file */
+    char* err_msg = NULL;
+    rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL", 0, 0, &err_msg);
+
+    /* the journal mode is stored in the database file, so this only fails
+       if another process is writing in rollback mode while we switch,
+       in which case the next connection will do it */
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "Cannot switch to wal mode: %s\n", err_msg);
+        sqlite3_free(err_msg);
+    }
+
+    char pragmas[256];
+    snprintf(pragmas, 256, "PRAGMA synchronous=NORMAL;"
+                           "PRAGMA cache_size=-%d;"
+                           "PRAGMA mmap_size=%d;", DB_CACHE_KB, DB_MMAP_SIZE);
+
+    rc = sqlite3_exec(db, pragmas, 0, 0, &err_msg);
+
+    if(rc != SQLITE_OK){
+        dberror(err_msg);
+
+        sqlite3_free(err_msg);
+    }
+
+    if(verbose){
+        printf("db opened\n");
+    }
+
+
+}
+
+/* statements for the hottest lookups, which pre-forked workers prepare
+   once and keep between sessions. anywhere else they are prepared and
+   finalized every time like any other statement */
+sqlite3_stmt* lookup_stmt = NULL;
+sqlite3_stmt* user_stmt = NULL;
+sqlite3_stmt* count_stmt = NULL;
+
+#define LOOKUP_SQL "SELECT path, digest FROM files WHERE mid=?"
+#define USER_SQL "SELECT * FROM users WHERE username = ?"
+#define COUNT_SQL "SELECT COUNT(*) FROM files"
+
+/* returns the kept statement if there is one, otherwise prepares it
+   (and keeps it, in a worker) */
+sqlite3_stmt* prepare_cached(sqlite3_stmt** cache, const char* sql){
+    sqlite3_stmt* stmt;
+
+    if(*cache != NULL){
+        return *cache;
+    }
+
+    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    if(prefork_worker){
+        *cache = stmt;
+    }
+
+    return stmt;
+}
+
+/* done with a statement from prepare_cached, a kept one is only reset */
+void release_cached(sqlite3_stmt** cache, sqlite3_stmt* stmt){
+    if(*cache == stmt){
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    } else {
+        sqlite3_finalize(stmt);
+    }
+}
+
+/* finalizes the kept statements, before closing the database */
+void finalize_cached(){
+    sqlite3_finalize(lookup_stmt);
+    sqlite3_finalize(user_stmt);
+    sqlite3_finalize(count_stmt);
+
+    lookup_stmt = NULL;
+    user_stmt = NULL;
+    count_stmt = NULL;
+}
+
+/* adds a column to an existing table unless it's already there,
+   for databases created before the column was introduced */
+void add_column(char* table, char* column, char* type){
+    char sql[256];
+    sqlite3_stmt* stmt;
+
+    if(sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?) WHERE name=?", -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to inspect schema");
+    }
+
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+
+    int exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+
+    if(exists){
+        return;
+    }
+
+    snprintf(sql, 256, "ALTER TABLE %s ADD COLUMN %s %s", table, column, type);
+
+    if(sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK){
+        dberror("Failed to add column");
+    }
+}
+
+/* creates the tables if they don't exist, this needs a write lock
+   so it is done once at startup rather than for every connection */
+void create_schema(){
+    char* schema = "CREATE TABLE IF NOT EXISTS users(username TEXT PRIMARY KEY, password TEXT);"
+                   "CREATE TABLE IF NOT EXISTS files(mid INTEGER PRIMARY KEY ASC, name TEXT, path TEXT);"
+                   "CREATE TABLE IF NOT EXISTS access(mid INTEGER PRIMARY KEY, score REAL, updated INTEGER);"
+                   "CREATE TABLE IF NOT EXISTS playlists(pid INTEGER PRIMARY KEY ASC, owner TEXT, name TEXT);"
+                   "CREATE TABLE IF NOT EXISTS playlist_items(pid INTEGER, pos INTEGER, mid INTEGER, "
+                   "PRIMARY KEY(pid, pos));"
+                   "CREATE TABLE IF NOT EXISTS retired(path TEXT PRIMARY KEY, at INTEGER);"
+                   CHANGES_SCHEMA;
+
+    char* err_msg = NULL;
+    int rc = sqlite3_exec(db, schema, 0, 0, &err_msg);
+    
+    if(rc != SQLITE_OK){
+        dberror(err_msg);
+
+        sqlite3_free(err_msg);
+    }
+
+    /* crc32c of the file, computed once and sent after every transfer */
+    add_column("files", "digest", "INTEGER");
+
+    /* length in milliseconds and number of frames, found by walking the frames
+       of uploaded files (see mp3scan.h), null for files added some other way */
+    add_column("files", "duration", "INTEGER");
+    add_column("files", "frames", "INTEGER");
+}
+
+void init_db(){
+    open_db();
+    create_schema();
+
+    load_access();
+    warm_cache();
+
+    sqlite3_close(db);
+}
+
+/* reads the cached checksum of a file from a result column,
+   -1 if it hasn't been computed yet */
+int64_t column_digest(sqlite3_stmt* stmt, int col){
+    if(sqlite3_column_type(stmt, col) == SQLITE_NULL){
+        return -1;
+    }
+
+    return (uint32_t)sqlite3_column_int64(stmt, col);
+}
+
+/* the columns of a snapshot while it's being built */
+struct snapshot_builder {
+    uint32_t count;
+    uint32_t capacity;
+
+    uint32_t* columns[SNAPSHOT_COLUMNS];
+
+    char* strings;
+    uint32_t strings_len;
+    uint32_t strings_capacity;
+};
+
+/* for qsort, which has no way of passing it to the comparison */
+struct snapshot_builder* sorting_builder;
+
+/* adds a string to the string area and returns its offset */
+uint32_t builder_string(struct snapshot_builder* b, const char* str){
+    uint32_t len = strlen(str) + 1;
+    uint32_t offset = b->strings_len;
+
+    while(b->strings_len + len > b->strings_capacity){
+        b->strings_capacity *= 2;
+        b->strings = realloc(b->strings, b->strings_capacity);
+    }
+
+    memcpy(b->strings + offset, str, len);
+    b->strings_len += len;
+
+    return offset;
+}
+
+int compare_names(const void* a, const void* b){
+    struct snapshot_builder* builder = sorting_builder;
+    uint32_t* names = builder->columns[SNAPSHOT_COLUMN_NAMES];
+
+    return strcmp(builder->strings + names[*(const uint32_t*)a],
+                  builder->strings + names[*(const uint32_t*)b]);
+}
+
+/* maps the latest snapshot if the committer has written a new one since,
+   returns whether there is one to use */
+int snapshot_refresh(){
+    if(snapshot_file == NULL){
+        return 0;
+    }
+
+    uint64_t generation = stats[STAT_SNAPSHOTS];
+
+    if(generation != catalog_generation){
+        struct snapshot fresh;
+
+        /* keep using the old one if the new one can't be mapped. the rows
+           were written by our own committer, only the header is checked */
+        if(snapshot_map(&fresh, snapshot_file, 0)){
+            snapshot_close(&catalog);
+            catalog = fresh;
+        } else {
+            fprintf(stderr, "Cannot map snapshot %s\n", snapshot_file);
+        }
+
+        catalog_generation = generation;
+    }
+
+    return catalog.base != NULL;
+}
+
+/* the version of the catalog and the number of files with a known checksum,
+   which together tell whether a snapshot is out of date */
+void catalog_state(uint32_t* version, uint32_t* digests){
+    sqlite3_stmt* stmt;
+    char* sql = "SELECT (SELECT IFNULL(MAX(version), 0) FROM changes), "
+                "(SELECT COUNT(digest) FROM files)";
+
+    if(sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW){
+        dberror("Failed to fetch data");
+    }
+
+    *version = sqlite3_column_int(stmt, 0);
+    *digests = sqlite3_column_int(stmt, 1);
+
+    sqlite3_finalize(stmt);
+}
+
+/* writes the files table to a snapshot file, which is built next to it
+   and renamed over it, so a snapshot that's mapped somewhere is never
+   changed underneath. needs an open database. returns 0 if it couldn't
+   be written, leaving the old one in place */
+int export_snapshot(const char* file){
+    struct snapshot_builder b;
+    struct snapshot_header header;
+    sqlite3_stmt* stmt;
+    uint32_t i;
+    int c;
+
+    memset(&b, 0, sizeof(b));
+    memset(&header, 0, sizeof(header));
+
+    /* sizes and mtimes of files still at the same path are taken from the
+       previous snapshot instead of another stat, files don't change once
+       they're in the catalog */
+    struct snapshot* previous = snapshot_refresh() ? &catalog : NULL;
+
+    b.capacity = 1024;
+    b.strings_capacity = 65536;
+    b.strings = malloc(b.strings_capacity);
+
+    for(c=0;c<SNAPSHOT_COLUMNS;c++){
+        b.columns[c] = malloc(b.capacity * sizeof(uint32_t));
+    }
+
+    /* offset zero is the empty string, so the string area is never empty */
+    builder_string(&b, "");
+
+    /* the version and the rows are read in the same transaction, so they match */
+    uint32_t digests;
+
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    catalog_state(&header.catalog_version, &digests);
+
+    /* the rows come out in media id order, which the mids column needs to be in */
+    if(sqlite3_prepare_v2(db, "SELECT mid, name, path, digest FROM files ORDER BY mid", -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        const char* name = (const char*)sqlite3_column_text(stmt, 1);
+        const char* path = (const char*)sqlite3_column_text(stmt, 2);
+        int64_t digest = column_digest(stmt, 3);
+        int row = previous != NULL ? snapshot_find(previous, sqlite3_column_int(stmt, 0)) : -1;
+        struct stat st;
+
+        if(b.count == b.capacity){
+            b.capacity *= 2;
+
+            for(c=0;c<SNAPSHOT_COLUMNS;c++){
+                b.columns[c] = realloc(b.columns[c], b.capacity * sizeof(uint32_t));
+            }
+        }
+
+        i = b.count++;
+
+        b.columns[SNAPSHOT_COLUMN_MIDS][i] = sqlite3_column_int(stmt, 0);
+        b.columns[SNAPSHOT_COLUMN_NAMES][i] = builder_string(&b, name ? name : "");
+        b.columns[SNAPSHOT_COLUMN_PATHS][i] = builder_string(&b, path ? path : "");
+        b.columns[SNAPSHOT_COLUMN_DIGESTS][i] = digest < 0 ? 0 : digest;
+        b.columns[SNAPSHOT_COLUMN_FLAGS][i] = digest < 0 ? 0 : SNAPSHOT_HAS_DIGEST;
+        b.columns[SNAPSHOT_COLUMN_BY_NAME][i] = i;
+
+        if(row >= 0 && path != NULL && !(previous->flags[row] & SNAPSHOT_MISSING) &&
+           strcmp(snapshot_path(previous, row), path) == 0){
+            b.columns[SNAPSHOT_COLUMN_SIZES][i] = previous->sizes[row];
+            b.columns[SNAPSHOT_COLUMN_MTIMES][i] = previous->mtimes[row];
+        } else if(path != NULL && stat(path, &st) == 0){
+            b.columns[SNAPSHOT_COLUMN_SIZES][i] = st.st_size;
+            b.columns[SNAPSHOT_COLUMN_MTIMES][i] = st.st_mtime;
+        } else {
+            b.columns[SNAPSHOT_COLUMN_SIZES][i] = 0;
+            b.columns[SNAPSHOT_COLUMN_MTIMES][i] = 0;
+            b.columns[SNAPSHOT_COLUMN_FLAGS][i] |= SNAPSHOT_MISSING;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+
+    sorting_builder = &b;
+    qsort(b.columns[SNAPSHOT_COLUMN_BY_NAME], b.count, sizeof(uint32_t), compare_names);
+
+    /* the columns follow the header one after the other, then the strings */
+    uint32_t* offsets = &header.mids;
+    uint32_t offset = sizeof(header);
+
+    for(c=0;c<SNAPSHOT_COLUMNS;c++){
+        offsets[c] = offset;
+        offset += b.count * sizeof(uint32_t);
+    }
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = b.count;
+    header.strings = offset;
+    header.strings_len = b.strings_len;
+
+    char tmp[512];
+    snprintf(tmp, 512, "%s.tmp", file);
+
+    /* this runs in the committer, which has to keep going if the disk
+       is full, so a snapshot that can't be written leaves the old one */
+    FILE* fp = fopen(tmp, "wb");
+
+    if(fp != NULL){
+        fwrite(&header, sizeof(header), 1, fp);
+
+        for(c=0;c<SNAPSHOT_COLUMNS;c++){
+            fwrite(b.columns[c], sizeof(uint32_t), b.count, fp);
+        }
+
+        fwrite(b.strings, 1, b.strings_len, fp);
+    }
+
+    for(c=0;c<SNAPSHOT_COLUMNS;c++){
+        free(b.columns[c]);
+    }
+
+    free(b.strings);
+
+    if(fp == NULL){
+        perror("Cannot create snapshot");
+        return 0;
+    }
+
+    if(fflush(fp) != 0 || ferror(fp)){
+        perror("Cannot write snapshot");
+        fclose(fp);
+        unlink(tmp);
+        return 0;
+    }
+
+    fclose(fp);
+
+    if(rename(tmp, file) < 0){
+        perror("Cannot replace snapshot");
+        unlink(tmp);
+        return 0;
+    }
+
+    stat_add(STAT_SNAPSHOTS, 1);
+
+    if(verbose){
+        printf("Exported %u files at version %u to %s\n", header.count, header.catalog_version, file);
+    }
+
+    return 1;
+}
+
+/* finds the path and checksum of a file in the snapshot, returns 0 if there's
+   no snapshot or it hasn't caught up with the file yet. checksums computed
+   since the snapshot was taken are only in the database, so files without
+   one are left to the database as well */
+int lookup_snapshot(int mid, char* path, int64_t* digest){
+    if(!snapshot_refresh()){
+        return 0;
+    }
+
+    int row = snapshot_find(&catalog, mid);
+
+    if(row < 0 || !(catalog.flags[row] & SNAPSHOT_HAS_DIGEST)){
+        return 0;
+    }
+
+    strncpy(path, snapshot_path(&catalog, row), 255);
+    *digest = catalog.digests[row];
+
+    return 1;
+}
+
+/* finds the path and checksum (-1 if not known yet) of a file,
+   returns 0 if there's no such file */
+int lookup_file(int mid, char* path, int64_t* digest){
+    if(lookup_snapshot(mid, path, digest)){
+        return 1;
+    }
+
+    sqlite3_stmt* stmt = prepare_cached(&lookup_stmt, LOOKUP_SQL);
+    int rc;
+
+    sqlite3_bind_int(stmt, 1, mid);
+
+    rc = sqlite3_step(stmt);
+
+    if(rc == SQLITE_ROW){
+        *digest = column_digest(stmt, 1);
+        strncpy(path, (const char*)sqlite3_column_text(stmt, 0), 255);
+    }
+
+    release_cached(&lookup_stmt, stmt);
+
+    return rc == SQLITE_ROW;
+}
+
+void do_echo(int sock){
+    /* clear buffer and read a string */
+    memset(buf, 0, 1024);
+    smdp_read_str(sock, buf, 1024);
+
+    /* write an echo command and write the string back */
+    smdp_write_int(sock, SMDP_ECHO);
+    smdp_write_str(sock, buf);
+}
+
+int list_callback(void* arg0, int argc, char** argv, char** colNames){
+
+    /* this callback is passed to sqlite3_exec as an argument
+       and socket handle is passed as an argument to it as well */
+    int sock = *(int*)arg0;
+
+    if(argc < 3){
+        fprintf(stderr, "Too few columns returned, (shouldn't happen unless database is corrupt)");
+        exit(1);
+    }
+
+    /* write the row command and three columns as strings (mid, name and path) */
+    smdp_write_int(sock, SMDP_ROW);
+    smdp_write_str(sock, argv[0]);
+    smdp_write_str(sock, argv[1]);
+    smdp_write_str(sock, argv[2]);
+
+    /* needs to return 0 for sqlite3_exec to continue with other rows */
+    return 0;
+}
+
+void do_list(int sock){
+
+    if(verbose){
+        printf("Handling list operation\n");
+    }
+
+    /* the snapshot has the whole catalog in order, no need for the database */
+    if(snapshot_refresh()){
+        char mid[16];
+        uint32_t i;
+
+        smdp_write_int(sock, SMDP_LIST);
+        smdp_write_int(sock, catalog.header->count);
+
+        for(i=0;i<catalog.header->count;i++){
+            snprintf(mid, 16, "%u", catalog.mids[i]);
+
+            smdp_write_int(sock, SMDP_ROW);
+            smdp_write_str(sock, mid);
+            smdp_write_str(sock, (char*)snapshot_name(&catalog, i));
+            smdp_write_str(sock, (char*)snapshot_path(&catalog, i));
+        }
+
+        return;
+    }
+
+    char* sql = "SELECT * FROM files";
+    char* err_msg = NULL;
+    int rc;
+
+    /* we need to find the number of rows to send */
+    sqlite3_stmt* stmt = prepare_cached(&count_stmt, COUNT_SQL);
+
+    rc = sqlite3_step(stmt);
+
+    if(rc != SQLITE_ROW){
+        dberror("Failed to fetch data");
+    }
+
+    int len = sqlite3_column_int(stmt, 0);
+
+    release_cached(&count_stmt, stmt);
+
+    /* send the command and number of rows */
+    smdp_write_int(sock, SMDP_LIST);
+    smdp_write_int(sock, len);
+
+    /* send the rows themselves (via list_callback function) */
+    rc = sqlite3_exec(db, sql, list_callback, &sock, &err_msg);
+
+    if(rc != SQLITE_OK){
+        dberror(err_msg);
+
+        sqlite3_free(err_msg);
+    }
+}
+
+/* sends every row added, changed or removed since the version the client has,
+   along with the current version of the catalog */
+void do_sync(int sock){
+    uint32_t since = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling sync operation from version %u\n", since);
+    }
+
+    sqlite3_stmt* stmt;
+    int rc;
+
+    /* a read transaction keeps the version, count and rows consistent
+       even if an upload is registered in the meantime */
+    rc = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    if(rc != SQLITE_OK){
+        dberror("Failed to begin transaction");
+    }
+
+    char* vsql = "SELECT IFNULL(MAX(version), 0) FROM changes";
+
+    rc = sqlite3_prepare_v2(db, vsql, -1, &stmt, 0);
+    if(rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW){
+        dberror("Failed to fetch data");
+    }
+
+    uint32_t version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    char* csql = "SELECT COUNT(DISTINCT mid) FROM changes WHERE version > ?";
+
+    rc = sqlite3_prepare_v2(db, csql, -1, &stmt, 0);
+    if(rc != SQLITE_OK){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_bind_int(stmt, 1, since);
+
+    if(sqlite3_step(stmt) != SQLITE_ROW){
+        dberror("Failed to fetch data");
+    }
+
+    int len = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    smdp_write_int(sock, SMDP_SYNC);
+    smdp_write_int(sock, version);
+    smdp_write_int(sock, len);
+
+    /* a changed mid that is no longer in the files table has been removed */
+    char* sql = "SELECT c.mid, f.name, f.path FROM "
+                "(SELECT DISTINCT mid FROM changes WHERE version > ?) c "
+                "LEFT JOIN files f ON f.mid = c.mid";
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    if(rc != SQLITE_OK){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_bind_int(stmt, 1, since);
+
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW){
+        const char* mid = (const char*)sqlite3_column_text(stmt, 0);
+
+        if(sqlite3_column_type(stmt, 1) == SQLITE_NULL){
+            smdp_write_int(sock, SMDP_REMOVED);
+            smdp_write_str(sock, (char*)mid);
+        } else {
+            smdp_write_int(sock, SMDP_ROW);
+            smdp_write_str(sock, (char*)mid);
+            smdp_write_str(sock, (char*)sqlite3_column_text(stmt, 1));
+            smdp_write_str(sock, (char*)sqlite3_column_text(stmt, 2));
+        }
+    }
+
+    if(rc != SQLITE_DONE){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
+void do_stats(int sock){
+    if(verbose){
+        printf("Handling stats operation\n");
+    }
+
+    char value[32];
+    int i;
+
+    smdp_write_int(sock, SMDP_STATS);
+    smdp_write_int(sock, STAT_COUNT);
+
+    for(i=0;i<STAT_COUNT;i++){
+        snprintf(value, 32, "%llu", (unsigned long long)stats[i]);
+
+        smdp_write_int(sock, SMDP_ROW);
+        smdp_write_str(sock, (char*)stat_names[i]);
+        smdp_write_str(sock, value);
+    }
+}
+
+void do_user(int sock){
+    /* just read a string from socket and write it to username buffer
+       no authentication done here */
+    memset(username, 0, 256);
+    smdp_read_str(sock, username, 256);
+
+    if(verbose){
+        printf("%s logging in\n", username);
+    }
+}
+
+void do_pass(int sock){
+    if(verbose){
+        printf("%s sent password\n", username);
+    }
+
+    /* read the password from socket connection into password buffer */
+    memset(password, 0, 256);  
+    smdp_read_str(sock, password, 256);
+
+    /* fetch username and password from database */
+    sqlite3_stmt* stmt = prepare_cached(&user_stmt, USER_SQL);
+    int rc;
+
+    sqlite3_bind_text(stmt, 1, username, strlen(username), SQLITE_STATIC);
+
+    rc = sqlite3_step(stmt);
+
+
+    if(rc == SQLITE_ROW){
+        /* a user with that username exists */
+        const char* realpass = (const char*)sqlite3_column_text(stmt, 1);
+
+        /* check if password matches 
+           (we really shouldn't be doing that - storing passwords in plaintext in db)
+           (but on the other hand, we really shouldn't be sending passwords 
+           in plaintext over network either) */
+
+        if(strcmp(password, realpass)==0){
+            authenticated = 1;
+        } else {
+            authenticated = 0;
+        }
+    } else {
+        /* no user with the specified username, deny authentication */
+        authenticated = 0;
+    }
+
+    release_cached(&user_stmt, stmt);
+
+    /* inform the client if authentication was successful or not */
+    if(authenticated){
+        if(verbose){
+            printf("%s successfully logged in\n", username);
+        }
+
+        smdp_write_int(sock, SMDP_ACCEPT);
+    } else {
+
+        if(verbose){
+            printf("Authentication failed for %s\n", username);
+        }
+
+        smdp_write_int(sock, SMDP_DENY);
+    }
+}
+
+/* remembers the checksum of a file computed while sending it,
+   if that fails it will simply be computed again next time */
+void cache_digest(int mid, uint32_t digest){
+    sqlite3_stmt* stmt;
+
+    if(sqlite3_prepare_v2(db, "UPDATE files SET digest=? WHERE mid=?", -1, &stmt, 0) != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    sqlite3_bind_int64(stmt, 1, digest);
+    sqlite3_bind_int(stmt, 2, mid);
+
+    if(sqlite3_step(stmt) != SQLITE_DONE){
+        fprintf(stderr, "Cannot cache checksum of %d: %s\n", mid, sqlite3_errmsg(db));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/* sends the file size followed by the contents of an open file
+   by reading the file into the buffer part by part, and then its checksum.
+   the checksum is computed at upload time and stored in the files table,
+   files that were added some other way get theirs computed on the fly
+   the first time they are sent, and cached for the next time.
+   a mid of 0 sends len bytes from the current position of fp (part of
+   a file), whose checksum is computed but not cached */
+void send_open_file(int sock, FILE* fp, uint32_t len, int mid, int64_t digest){
+    uint32_t crc = 0;
+    off_t offset = ftello(fp);
+
+    smdp_write_int(sock, len);
+
+    /* what we send is read front to back, so let the kernel read ahead
+       aggressively and start fetching it right away */
+    posix_fadvise(fileno(fp), offset, len, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(fp), offset, len, POSIX_FADV_WILLNEED);
+    
+    uint32_t counter = 0;
+
+    /* whether everything sent so far really came from the file */
+    int intact = 1;
+
+    /* read into the buffer and send part by part until end of file */
+    while(counter < len){
+        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
+        memset(buf, 0, 1024);
+
+        /* a file that got shorter in the meantime is padded with zeros,
+           to keep the stream in sync with the size already sent */
+        if(fread(buf, sizeof(char), to_read, fp) != to_read){
+            intact = 0;
+        }
+
+        int n = write(sock, buf, to_read);
+        
+        if(n < 0){
+            error("Error writing to socket");
+        }
+
+        smdp_bytes_out += n;
+
+        if(digest < 0){
+            crc = smdp_crc32c(crc, buf, to_read);
+        }
+
+        counter += to_read;
+    }
+
+    if(!intact){
+        fprintf(stderr, "File %d ended early, sent zeros instead\n", mid);
+    }
+
+    /* the checksum of padded data is worthless, so nothing is cached and
+       the client gets one that can't match what it received. a cached
+       checksum is that of the real file, which doesn't match either */
+    if(digest < 0 && !intact){
+        digest = ~crc;
+    } else if(digest < 0){
+        digest = crc;
+
+        if(mid != 0){
+            cache_digest(mid, crc);
+        }
+    }
+
+    smdp_write_int(sock, digest);
+}
+
+/* keeps the stream in sync with the size already sent when a file can't
+   be read at all, by sending zeros followed by a checksum that can't
+   match them, so the client throws them away */
+void send_zeros(int sock, uint32_t len){
+    uint32_t crc = 0;
+    uint32_t counter = 0;
+
+    smdp_write_int(sock, len);
+    memset(buf, 0, 1024);
+
+    while(counter < len){
+        uint32_t to_write = (len-counter<1024)?(len-counter):1024;
+        int n = write(sock, buf, to_write);
+
+        if(n < 0){
+            error("Error writing to socket");
+        }
+
+        smdp_bytes_out += n;
+        crc = smdp_crc32c(crc, buf, n);
+        counter += n;
+    }
+
+    smdp_write_int(sock, ~crc);
+}
+
+/* sends the file size followed by the contents of the file */
+void send_file_data(int sock, const char* path, uint32_t len, int mid, int64_t digest){
+    /* open the file */
+    FILE* fp;
+
+    fp = fopen(path, "rb");
+
+    if(fp == NULL){
+        /* the size has been promised already */
+        fprintf(stderr, "Cannot open %s\n", path);
+        send_zeros(sock, len);
+        return;
+    }
+
+    send_open_file(sock, fp, len, mid, digest);
+
+    fclose(fp);
+}
+
+/* reads a file from given path and sends it through the socket connection
+   by reading the file into the buffer */
+void send_file(int sock, const char* path, int mid, int64_t digest){
+
+    if(verbose){
+        printf("Sending file %s\n", path);
+    }
+
+    struct stat st;
+
+    /* stat returns -1 when the given file does not exist */
+    if(stat(path, &st) < 0){
+        /* so in that case just send nofile, but that shouldn't happen
+           unless a non-existent path is in the database */
+        smdp_write_int(sock, SMDP_NOFILE);
+        fprintf(stderr, "File not found: %s\n", path);
+        return;
+    }
+
+    /* send the file command, then the file size and contents */
+    smdp_write_int(sock, SMDP_FILE);
+    send_file_data(sock, path, st.st_size, mid, digest);
+}
+
+/* like send_file, but also sends the modification time of the file
+   so the client can use size and mtime to validate its cached copy later.
+   if the client already has a copy with the same size and mtime,
+   only a not modified response is sent */
+void send_file_if(int sock, const char* path, uint32_t size, uint32_t mtime, int mid, int64_t digest){
+    struct stat st;
+
+    if(stat(path, &st) < 0){
+        smdp_write_int(sock, SMDP_NOFILE);
+        fprintf(stderr, "File not found: %s\n", path);
+        return;
+    }
+
+    if((uint32_t)st.st_size == size && (uint32_t)st.st_mtime == mtime){
+        if(verbose){
+            printf("File %s not modified\n", path);
+        }
+
+        smdp_write_int(sock, SMDP_NOT_MODIFIED);
+        return;
+    }
+
+    if(verbose){
+        printf("Sending file %s\n", path);
+    }
+
+    smdp_write_int(sock, SMDP_FILE);
+    smdp_write_int(sock, st.st_mtime);
+    send_file_data(sock, path, st.st_size, mid, digest);
+}
+
+/* receives a file and the checksum that follows it, verifying the checksum
+   and walking the mp3 frames as the data comes in. returns NULL and the
+   checksum if it matches and the file is a complete mp3 file, otherwise
+   removes the file and returns what's wrong with it */
+const char* receive_file(int sock, char* path, uint32_t* digest, struct mp3scan* scan){
+    FILE* fp;
+    uint32_t crc = 0;
+
+    fp = fopen(path, "wb");
+    mp3scan_init(scan);
+
+    if(fp == NULL){
+        error("Cannot create upload");
+    }
+    
+    uint32_t len = smdp_read_int(sock);
+    if(verbose){
+        printf("received length %d\n", len);
+    }
+    uint32_t counter = 0;
+
+    /* read into the buffer and send part by part until end of file */
+    while(counter < len){
+        uint32_t to_read = (len-counter<1024)?(len-counter):1024;
+        int n = read(sock, buf, to_read);
+
+        if(n < 0){
+            error("Error reading from socket");
+        } else if(n == 0){
+            fprintf(stderr, "Connection closed during transfer\n");
+            exit(1);
+        }
+
+        smdp_bytes_in += n;
+
+        /* read may return less than we asked for, only keep what we got */
+        fwrite(buf, sizeof(char), n, fp);
+        crc = smdp_crc32c(crc, buf, n);
+        mp3scan_feed(scan, buf, n);
+        
+        counter += n;
+    }
+
+    *digest = smdp_read_int(sock);
+    mp3scan_finish(scan);
+
+    if(*digest != crc){
+        fprintf(stderr, "Checksum mismatch for %s: expected %08x, got %08x\n", path, *digest, crc);
+        fclose(fp);
+        unlink(path);
+        return "checksum mismatch";
+    }
+
+    /* no point in keeping something that won't be registered */
+    const char* problem = mp3scan_problem(scan);
+
+    if(problem != NULL){
+        fprintf(stderr, "Rejecting %s: %s (%u frames, %llu bytes of junk)\n", path, problem,
+                scan->frames, (unsigned long long)scan->junk_bytes);
+        fclose(fp);
+        unlink(path);
+        return problem;
+    }
+
+    /* the file has to be on disk before it is registered in the database,
+       otherwise a crash could leave a row pointing to a truncated file */
+    fflush(fp);
+    fsync(fileno(fp));
+
+    fclose(fp);
+    return NULL;
+}
+
+void do_file(int sock){
+
+    int mid = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling file command for id %d\n", mid);
+    }
+
+
+    /* reject if the client isn't authenticated */
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    /* look up the requested media id, no read transaction
+       is held open during the transfer */
+    char path[256] = {0};
+    int64_t digest;
+
+    if(lookup_file(mid, path, &digest)){
+        /* found the file, send it */
+        record_access(mid);
+        send_file(sock, path, mid, digest);
+    } else {
+
+        if(verbose){
+            printf("File with id %d not found\n", mid);
+        }
+
+        /* no file with that id exists */
+        smdp_write_int(sock, SMDP_NOFILE);
+    }
+
+    end_transfer();
+}
+
+/* sends the crc32c checksum of an open file, computing (and caching)
+   it first if the files table doesn't have it yet */
+void send_fd_digest(int sock, int fd, int mid, int64_t digest){
+    if(digest < 0){
+        uint32_t crc = 0;
+        off_t offset = 0;
+        int n;
+
+        while((n = pread(fd, buf, 1024, offset)) > 0){
+            crc = smdp_crc32c(crc, buf, n);
+            offset += n;
+        }
+
+        digest = crc;
+        cache_digest(mid, crc);
+    }
+
+    smdp_write_int(sock, digest);
+}
+
+/* answers a file request with an open descriptor of the file instead of
+   its contents, so a client on the same host can read or map it directly
+   without every byte going through us. only for authenticated clients
+   connected through the unix socket */
+void do_file_fd(int sock){
+    int mid = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling file descriptor command for id %d\n", mid);
+    }
+
+    if(!authenticated || !local_session){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    char path[256] = {0};
+    int64_t digest = -1;
+    int found = lookup_file(mid, path, &digest);
+
+    struct stat st;
+    int fd = found ? open(path, O_RDONLY) : -1;
+
+    if(fd < 0 || fstat(fd, &st) < 0){
+        if(verbose){
+            printf("File with id %d not found\n", mid);
+        }
+
+        if(fd >= 0){
+            close(fd);
+        }
+
+        smdp_write_int(sock, SMDP_NOFILE);
+        return;
+    }
+
+    record_access(mid);
+
+    /* the client gets its own copy of the descriptor, ours can go right away */
+    smdp_write_fd(sock, SMDP_FILE_FD, fd);
+    smdp_write_int(sock, st.st_size);
+    send_fd_digest(sock, fd, mid, digest);
+
+    close(fd);
+}
+
+/* sends part of a file, so a client can fetch the parts of a large file
+   over several connections at once. a zero length part just tells the client
+   how large the file is */
+void do_range(int sock){
+    int mid = smdp_read_int(sock);
+    uint32_t offset = smdp_read_int(sock);
+    uint32_t len = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling range command for id %d (%u bytes at %u)\n", mid, len, offset);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    char path[256] = {0};
+    int64_t digest;
+    int found = lookup_file(mid, path, &digest);
+
+    FILE* fp = found ? fopen(path, "rb") : NULL;
+    struct stat st;
+
+    if(fp == NULL || fstat(fileno(fp), &st) < 0){
+        if(fp != NULL){
+            fclose(fp);
+        }
+
+        smdp_write_int(sock, SMDP_NOFILE);
+        end_transfer();
+        return;
+    }
+
+    /* parts past the end of the file are cut short */
+    if(offset > st.st_size){
+        offset = st.st_size;
+    }
+
+    if(len > st.st_size - offset){
+        len = st.st_size - offset;
+    }
+
+    /* only count the file as played once */
+    if(offset == 0 && len > 0){
+        record_access(mid);
+    }
+
+    fseeko(fp, offset, SEEK_SET);
+
+    smdp_write_int(sock, SMDP_FILE);
+    smdp_write_int(sock, st.st_size);
+    send_open_file(sock, fp, len, 0, -1);
+
+    fclose(fp);
+    end_transfer();
+}
+
+/* sends the catalog snapshot straight from our mapping of it, so clients
+   can keep a copy and browse the catalog without asking us */
+void do_snapshot(int sock){
+    if(verbose){
+        printf("Handling snapshot command\n");
+    }
+
+    if(!snapshot_refresh()){
+        smdp_write_int(sock, SMDP_NOFILE);
+        return;
+    }
+
+    size_t sent = 0;
+
+    smdp_write_int(sock, SMDP_FILE);
+    smdp_write_int(sock, catalog.size);
+
+    while(sent < catalog.size){
+        int n = write(sock, catalog.base + sent, catalog.size - sent);
+
+        if(n < 0){
+            error("Error writing to socket");
+        }
+
+        smdp_bytes_out += n;
+        sent += n;
+    }
+
+    smdp_write_int(sock, smdp_crc32c(0, catalog.base, catalog.size));
+}
+
+void do_file_if(int sock){
+
+    /* media id and the validators of the client's cached copy
+       (both zero if the client has no cached copy) */
+    int mid = smdp_read_int(sock);
+    uint32_t size = smdp_read_int(sock);
+    uint32_t mtime = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling conditional file command for id %d\n", mid);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    char path[256] = {0};
+    int64_t digest;
+
+    if(lookup_file(mid, path, &digest)){
+        record_access(mid);
+        send_file_if(sock, path, size, mtime, mid, digest);
+    } else {
 
         if(verbose){
             printf("File with id %d not found\n", mid);
         }
 
-        /* no file with that id exists */
-        smdp_write_int(sock, SMDP_NOFILE);
+        smdp_write_int(sock, SMDP_NOFILE);
+    }
+
+    end_transfer();
+}
+
+struct bundle_entry {
+    int mid;
+    int64_t digest;
+    char path[256];
+    struct stat st;
+    FILE* fp;
+};
+
+/* orders bundle entries by device and inode number, which roughly follows
+   the order the files were written to disk in, so the disk doesn't seek
+   back and forth while the bundle is streamed */
+int compare_disk_order(const void* a, const void* b){
+    const struct bundle_entry* x = a;
+    const struct bundle_entry* y = b;
+
+    if(x->st.st_dev != y->st.st_dev){
+        return x->st.st_dev < y->st.st_dev ? -1 : 1;
+    }
+
+    if(x->st.st_ino != y->st.st_ino){
+        return x->st.st_ino < y->st.st_ino ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* sends a list of files as a single stream: the number of entries, then for
+   each entry its id followed by a file response or a nofile response */
+void do_bundle(int sock){
+    uint32_t count = smdp_read_int(sock);
+
+    uint32_t extra = 0;
+
+    if(count > SMDP_BUNDLE_MAX){
+        fprintf(stderr, "Bundle of %u files is too large\n", count);
+        extra = count - SMDP_BUNDLE_MAX;
+        count = SMDP_BUNDLE_MAX;
+    }
+
+    struct bundle_entry* entries = calloc(count, sizeof(struct bundle_entry));
+    uint32_t i;
+
+    for(i=0;i<count;i++){
+        entries[i].mid = smdp_read_int(sock);
+    }
+
+    /* the ids past the limit are still on their way, read and drop them
+       or they would be taken for the next requests */
+    uint64_t skip = (uint64_t)extra * sizeof(uint32_t);
+
+    while(skip > 0){
+        int n = read(sock, buf, skip < sizeof(buf) ? skip : sizeof(buf));
+
+        if(n <= 0){
+            break;
+        }
+
+        smdp_bytes_in += n;
+        skip -= n;
+    }
+
+    if(verbose){
+        printf("Handling bundle of %u files\n", count);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        free(entries);
+        return;
+    }
+
+    /* the whole bundle counts as a single transfer */
+    if(!begin_transfer(sock)){
+        free(entries);
+        return;
+    }
+
+    /* one statement for every lookup, the per file cost is a bind and a step */
+    sqlite3_stmt* stmt = prepare_cached(&lookup_stmt, LOOKUP_SQL);
+
+    for(i=0;i<count;i++){
+        int found = lookup_snapshot(entries[i].mid, entries[i].path, &entries[i].digest);
+
+        if(!found){
+            sqlite3_bind_int(stmt, 1, entries[i].mid);
+
+            if(sqlite3_step(stmt) == SQLITE_ROW){
+                strncpy(entries[i].path, (const char*)sqlite3_column_text(stmt, 0), 255);
+                entries[i].digest = column_digest(stmt, 1);
+                found = 1;
+            }
+
+            sqlite3_reset(stmt);
+        }
+
+        /* every file is opened right away, so one the migrator moves
+           (and removes from its old place) while the bundle is still
+           streaming is sent all the same. files that can't be found
+           keep a zeroed stat and sort first */
+        if(found){
+            entries[i].fp = fopen(entries[i].path, "rb");
+
+            if(entries[i].fp == NULL || fstat(fileno(entries[i].fp), &entries[i].st) < 0){
+                entries[i].path[0] = 0;
+            }
+        }
+    }
+
+    release_cached(&lookup_stmt, stmt);
+
+    qsort(entries, count, sizeof(struct bundle_entry), compare_disk_order);
+
+    smdp_write_int(sock, SMDP_BUNDLE);
+    smdp_write_int(sock, count);
+
+    for(i=0;i<count;i++){
+        smdp_write_int(sock, entries[i].mid);
+
+        if(entries[i].path[0] == 0){
+            smdp_write_int(sock, SMDP_NOFILE);
+
+            if(entries[i].fp != NULL){
+                fclose(entries[i].fp);
+            }
+
+            continue;
+        }
+
+        record_access(entries[i].mid);
+
+        smdp_write_int(sock, SMDP_FILE);
+        send_open_file(sock, entries[i].fp, entries[i].st.st_size, entries[i].mid, entries[i].digest);
+        fclose(entries[i].fp);
+    }
+
+    free(entries);
+    end_transfer();
+}
+
+void do_random(int sock){
+
+    if(verbose){
+        printf("Handling random file command\n");
+    }
+
+    /* reject if the client isn't authenticated */
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    /* get a random row from database */
+    char* sql = "SELECT mid, path, digest FROM files ORDER BY RANDOM() LIMIT 1";
+
+    sqlite3_stmt* stmt;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    if(rc != SQLITE_OK){
+        dberror("Failed to execute statement");
+    }
+
+    rc = sqlite3_step(stmt);
+
+
+    if(rc == SQLITE_ROW){
+        /* found one, send its id and then send the file */
+        int mid = sqlite3_column_int(stmt, 0);
+        int64_t digest = column_digest(stmt, 2);
+        char path[256] = {0};
+        strncpy(path, (const char*)sqlite3_column_text(stmt, 1), 255);
+        sqlite3_reset(stmt);
+
+        printf("%d %s\n", mid, path);
+
+        record_access(mid);
+
+        /* the mtime is sent along so the client can cache the file */
+        smdp_write_int(sock, mid);
+        send_file_if(sock, path, 0, 0, mid, digest);
+    } else {
+        /* apparently, there are no rows in the table */
+        fprintf(stderr, "There are no files in the database, really?\n");
+        smdp_write_int(sock, SMDP_NOFILE);
+    }
+
+    sqlite3_finalize(stmt);
+    end_transfer();
+}
+
+void do_playlist_create(int sock){
+    char name[256];
+
+    memset(name, 0, 256);
+    smdp_read_str(sock, name, 256);
+
+    if(verbose){
+        printf("Creating playlist %s\n", name);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    char* sql = "INSERT INTO playlists(owner, name) VALUES(?, ?)";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+
+    if(sqlite3_step(stmt) != SQLITE_DONE){
+        dberror("Failed to execute statement");
+    }
+
+    sqlite3_finalize(stmt);
+
+    smdp_write_int(sock, SMDP_ACCEPT);
+    smdp_write_int(sock, sqlite3_last_insert_rowid(db));
+}
+
+void do_playlist_append(int sock){
+    int pid = smdp_read_int(sock);
+    int mid = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Appending %d to playlist %d\n", mid, pid);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    /* only the owner of a playlist can change it */
+    char* osql = "SELECT owner FROM playlists WHERE pid=?";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, osql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    sqlite3_bind_int(stmt, 1, pid);
+
+    int owner = sqlite3_step(stmt) == SQLITE_ROW &&
+                strcmp((const char*)sqlite3_column_text(stmt, 0), username) == 0;
+
+    sqlite3_finalize(stmt);
+
+    if(!owner){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    char* sql = "INSERT INTO playlist_items(pid, pos, mid) "
+                "SELECT ?1, IFNULL((SELECT MAX(pos) + 1 FROM playlist_items WHERE pid=?1), 0), mid "
+                "FROM files WHERE mid=?2";
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to prepare statement");
+    }
+
+    sqlite3_bind_int(stmt, 1, pid);
+    sqlite3_bind_int(stmt, 2, mid);
+
+    if(sqlite3_step(stmt) != SQLITE_DONE){
+        dberror("Failed to execute statement");
+    }
+
+    sqlite3_finalize(stmt);
+
+    /* nothing is inserted if there's no such file */
+    smdp_write_int(sock, sqlite3_changes(db) > 0 ? SMDP_ACCEPT : SMDP_NOFILE);
+}
+
+/* sends the tracks of a playlist in order, in the same format as a listing */
+void do_playlist_get(int sock){
+    int pid = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Handling playlist %d\n", pid);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    char* csql = "SELECT COUNT(*) FROM playlist_items i JOIN files f ON f.mid = i.mid WHERE i.pid=?";
+    char* sql = "SELECT f.mid, f.name, f.path FROM playlist_items i JOIN files f ON f.mid = i.mid "
+                "WHERE i.pid=? ORDER BY i.pos";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, csql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_bind_int(stmt, 1, pid);
+
+    if(sqlite3_step(stmt) != SQLITE_ROW){
+        dberror("Failed to fetch data");
+    }
+
+    int len = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    smdp_write_int(sock, SMDP_LIST);
+    smdp_write_int(sock, len);
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_bind_int(stmt, 1, pid);
+
+    while(len > 0 && sqlite3_step(stmt) == SQLITE_ROW){
+        smdp_write_int(sock, SMDP_ROW);
+        smdp_write_str(sock, (char*)sqlite3_column_text(stmt, 0));
+        smdp_write_str(sock, (char*)sqlite3_column_text(stmt, 1));
+        smdp_write_str(sock, (char*)sqlite3_column_text(stmt, 2));
+        len--;
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+/* opens the track at the given position of the play queue and asks the kernel
+   to start reading its beginning, so it is ready by the time it's requested */
+void prefetch_track(int pos){
+    prefetched.mid = 0;
+    prefetched.fp = NULL;
+    prefetched.len = 0;
+
+    if(pos >= play_queue_len){
+        return;
+    }
+
+    prefetched.mid = play_queue[pos];
+
+    char path[256] = {0};
+
+    if(lookup_file(prefetched.mid, path, &prefetched.digest)){
+        struct stat st;
+
+        prefetched.fp = fopen(path, "rb");
+
+        if(prefetched.fp != NULL && fstat(fileno(prefetched.fp), &st) == 0){
+            prefetched.len = st.st_size;
+            posix_fadvise(fileno(prefetched.fp), 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+
+            if(verbose){
+                printf("Prefetching %s\n", path);
+            }
+        }
+    }
+}
+
+void clear_play_queue(){
+    if(prefetched.fp != NULL){
+        fclose(prefetched.fp);
+    }
+
+    prefetched.mid = 0;
+    prefetched.fp = NULL;
+
+    free(play_queue);
+    play_queue = NULL;
+    play_queue_len = 0;
+    play_queue_pos = 0;
+}
+
+/* loads a playlist into the play queue of the session */
+void do_play(int sock){
+    int pid = smdp_read_int(sock);
+
+    if(verbose){
+        printf("Playing playlist %d\n", pid);
+    }
+
+    if(!authenticated){
+        smdp_write_int(sock, SMDP_DENY);
+        return;
+    }
+
+    clear_play_queue();
+
+    char* sql = "SELECT mid FROM playlist_items WHERE pid=? ORDER BY pos";
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+
+    if(rc != SQLITE_OK){
+        dberror("Failed to fetch data");
+    }
+
+    sqlite3_bind_int(stmt, 1, pid);
+
+    int size = 0;
+
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        if(play_queue_len == size){
+            size = size ? size * 2 : 16;
+            play_queue = realloc(play_queue, size * sizeof(int));
+        }
+
+        play_queue[play_queue_len++] = sqlite3_column_int(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+
+    if(play_queue_len == 0){
+        smdp_write_int(sock, SMDP_NOFILE);
+        return;
+    }
+
+    smdp_write_int(sock, SMDP_ACCEPT);
+    smdp_write_int(sock, play_queue_len);
+
+    prefetch_track(0);
+}
+
+/* sends the next track of the play queue. the track after it is opened and
+   read ahead before this one is sent, and its id and length are pushed to
+   the client along with this track so the player knows what's coming */
+void do_next(int sock){
+    if(verbose){
+        printf("Handling next command\n");
+    }
+
+    if(prefetched.mid == 0){
+        smdp_write_int(sock, SMDP_NOFILE);
+        return;
+    }
+
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    struct queued_track current = prefetched;
+
+    play_queue_pos++;
+    prefetch_track(play_queue_pos);
+
+    smdp_write_int(sock, SMDP_NEXT);
+    smdp_write_int(sock, current.mid);
+    smdp_write_int(sock, prefetched.mid);
+    smdp_write_int(sock, prefetched.len);
+
+    if(current.fp == NULL){
+        smdp_write_int(sock, SMDP_NOFILE);
+        end_transfer();
+        return;
+    }
+
+    record_access(current.mid);
+
+    smdp_write_int(sock, SMDP_FILE);
+    send_open_file(sock, current.fp, current.len, current.mid, current.digest);
+
+    fclose(current.fp);
+    end_transfer();
+}
+
+/* inserts uploaded files into the files table in a single transaction */
+/* registers a batch of uploads in one transaction. returns 0 (with
+   nothing registered) if it fails, so the batch can be tried again */
+int register_uploads(struct ingest_record* recs, int count){
+    char* sql = "INSERT INTO files(name, path, digest, duration, frames) VALUES(?, ?, ?, ?, ?)";
+
+    sqlite3_stmt* stmt;
+    int rc;
+    int i;
+
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "Failed to begin transaction: %s\n", sqlite3_errmsg(db));
+        return 0;
+    }
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+
+    for(i=0;i<count;i++){
+        sqlite3_bind_text(stmt, 1, recs[i].name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, recs[i].path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, recs[i].digest);
+        sqlite3_bind_int64(stmt, 4, recs[i].duration);
+        sqlite3_bind_int64(stmt, 5, recs[i].frames);
+
+        rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if(rc != SQLITE_DONE){
+            fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            return 0;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    if(rc != SQLITE_OK){
+        fprintf(stderr, "Failed to commit: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+
+    stat_add(STAT_INGEST_FILES, count);
+    stat_add(STAT_INGEST_BATCHES, 1);
+
+    if(verbose){
+        printf("Registered %d uploads\n", count);
+    }
+
+    return 1;
+}
+
+/* reads exactly one record from the ingest pipe,
+   returns 0 when every writer has closed the pipe */
+int read_record(int fd, struct ingest_record* rec){
+    char* p = (char*)rec;
+    int left = sizeof(*rec);
+
+    while(left > 0){
+        int n = read(fd, p, left);
+
+        if(n < 0 && errno == EINTR){
+            continue;
+        } else if(n < 0){
+            error("Error reading from ingest pipe");
+        } else if(n == 0){
+            return 0;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    return 1;
+}
+
+volatile sig_atomic_t committer_stopping = 0;
+
+void stop_committer(int sig){
+    committer_stopping = 1;
+}
+
+/* the committer collects uploads from the ingest pipe and registers them
+   in batches, so a burst of uploads costs one transaction commit
+   instead of one commit (and fsync) per file */
+void run_committer(int fd){
+    struct ingest_record recs[INGEST_BATCH];
+    int open = 1;
+
+    open_db();
+
+    time_t flushed = time(NULL);
+
+    /* what the snapshot written at startup was taken from,
+       and whether the catalog has changed since the last one */
+    uint32_t version = 0, digests = 0;
+    time_t exported = 0;
+    int stale = 0;
+
+    /* committer_pid is still that of the previous committer if this one
+       replaces it, which may have registered uploads it never exported */
+    if(committer_pid != 0){
+        stale = 1;
+    }
+
+    if(snapshot_file != NULL){
+        catalog_state(&version, &digests);
+    }
+
+    /* save the counters before going away */
+    signal(SIGTERM, stop_committer);
+    signal(SIGINT, stop_committer);
+
+    while(open && !committer_stopping){
+        int count = 0;
+
+        /* the access counters are saved every once in a while */
+        time_t current = time(NULL);
+
+        if(current - flushed >= ACCESS_FLUSH_INTERVAL){
+            flush_access();
+            flushed = current;
+
+            /* the catalog can also be changed by other tools, and checksums
+               computed while sending files end up in the snapshot this way */
+            if(snapshot_file != NULL){
+                uint32_t new_version, new_digests;
+                catalog_state(&new_version, &new_digests);
+
+                if(new_version != version || new_digests != digests){
+                    stale = 1;
+                }
+            }
+        }
+
+        /* a burst of batches ends up in a single snapshot */
+        if(stale && current - exported >= SNAPSHOT_MIN_INTERVAL){
+            /* one that fails is tried again after the same interval */
+            catalog_state(&version, &digests);
+            stale = !export_snapshot(snapshot_file);
+            exported = current;
+        }
+
+        /* wait until the first upload of the next batch arrives,
+           or it's time for the next flush or snapshot */
+        struct timeval wait;
+        wait.tv_sec = ACCESS_FLUSH_INTERVAL - (current - flushed);
+        wait.tv_usec = 0;
+
+        if(stale && SNAPSHOT_MIN_INTERVAL - (current - exported) < wait.tv_sec){
+            wait.tv_sec = SNAPSHOT_MIN_INTERVAL - (current - exported);
+        }
+
+        fd_set waitfds;
+        FD_ZERO(&waitfds);
+        FD_SET(fd, &waitfds);
+
+        int res = select(fd + 1, &waitfds, NULL, NULL, &wait);
+
+        if(res < 0 && errno != EINTR){
+            error("select() failed");
+        } else if(res <= 0){
+            continue;
+        }
+
+        if(!read_record(fd, &recs[count])){
+            break;
+        }
+
+        count++;
+
+        struct timeval deadline, now, tv;
+        gettimeofday(&deadline, NULL);
+        deadline.tv_usec += INGEST_DELAY_MS * 1000;
+        deadline.tv_sec += deadline.tv_usec / 1000000;
+        deadline.tv_usec %= 1000000;
+
+        /* then keep collecting until the batch is full or the delay is over */
+        while(count < INGEST_BATCH){
+            gettimeofday(&now, NULL);
+            timersub(&deadline, &now, &tv);
+
+            if(tv.tv_sec < 0){
+                break;
+            }
+
+            fd_set readfds;
+            FD_ZERO(&readfds);
+            FD_SET(fd, &readfds);
+
+            if(select(fd + 1, &readfds, NULL, NULL, &tv) <= 0){
+                break;
+            }
+
+            if(!read_record(fd, &recs[count])){
+                open = 0;
+                break;
+            }
+
+            count++;
+        }
+
+        /* the clients have been told their uploads made it already, so a batch
+           that can't be registered (the database being busy for too long,
+           say) is tried again until it is */
+        while(!register_uploads(recs, count)){
+            if(committer_stopping){
+                fprintf(stderr, "Lost %d uploads\n", count);
+                break;
+            }
+
+            sleep(INGEST_RETRY_INTERVAL);
+        }
+
+        /* new uploads show up in listings once they're in the snapshot */
+        if(snapshot_file != NULL){
+            stale = 1;
+        }
+    }
+
+    flush_access();
+    sqlite3_close(db);
+}
+
+void start_committer(){
+    if(ingest_fd < 0){
+        int fds[2];
+
+        if(pipe(fds) < 0){
+            error("Error creating ingest pipe");
+        }
+
+        ingest_read_fd = fds[0];
+        ingest_fd = fds[1];
+    }
+
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        close(ingest_fd);
+        run_committer(ingest_read_fd);
+        exit(0);
+    }
+
+    committer_pid = pid;
+}
+
+/* starts a new committer if the one that ended didn't stop on its own,
+   returns whether pid was the committer */
+int restart_committer(int pid, int status){
+    if(pid != committer_pid){
+        return 0;
+    }
+
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0){
+        return 1;
+    }
+
+    fprintf(stderr, "Committer exited, restarting\n");
+    start_committer();
+
+    return 1;
+}
+
+/* adds a storage tier given as directory[:capacity in megabytes] */
+void add_tier(char* spec){
+    if(tier_count == MAX_TIERS){
+        fprintf(stderr, "At most %d tiers\n", MAX_TIERS);
+        exit(1);
+    }
+
+    struct tier* t = &tiers[tier_count++];
+    char* colon = strrchr(spec, ':');
+
+    t->capacity = 0;
+
+    if(colon != NULL){
+        *colon = 0;
+        t->capacity = strtoull(colon + 1, NULL, 10) * 1024 * 1024;
+    }
+
+    strncpy(t->dir, spec, 255);
+
+    size_t len = strlen(t->dir);
+
+    while(len > 1 && t->dir[len - 1] == '/'){
+        t->dir[--len] = 0;
+    }
+
+    upload_dir = t->dir;
+}
+
+/* makes sure every tier (or the upload directory) exists and can be written,
+   and that every tier but the last says how much it can hold */
+void check_tiers(){
+    int i;
+
+    for(i=0;i<tier_count-1;i++){
+        if(tiers[i].capacity == 0){
+            fprintf(stderr, "Tier %s needs a capacity, only the last tier is unlimited\n", tiers[i].dir);
+            exit(1);
+        }
+    }
+
+    for(i=0;i<(tier_count > 0 ? tier_count : 1);i++){
+        char* dir = tier_count > 0 ? tiers[i].dir : upload_dir;
+
+        if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+            fprintf(stderr, "Cannot create %s: %s\n", dir, strerror(errno));
+            exit(1);
+        }
+
+        if(access(dir, W_OK) < 0){
+            fprintf(stderr, "Cannot write to %s: %s\n", dir, strerror(errno));
+            exit(1);
+        }
     }
 }
 
-void do_random(int sock){
+/* which tier a path is on, -1 if none */
+int tier_of(const char* path){
+    int i;
 
-    if(verbose){
-        printf("Handling random file command\n");
+    for(i=0;i<tier_count;i++){
+        size_t len = strlen(tiers[i].dir);
+
+        if(strncmp(path, tiers[i].dir, len) == 0 && path[len] == '/'){
+            return i;
+        }
     }
 
-    /* reject if the client isn't authenticated */
-    if(!authenticated){
-        smdp_write_int(sock, SMDP_DENY);
-        return;
+    return -1;
+}
+
+/* creates the missing directories leading to a file */
+void make_parents(const char* path){
+    char dir[512];
+    char* p;
+
+    strncpy(dir, path, 511);
+    dir[511] = 0;
+
+    for(p=dir+1;*p;p++){
+        if(*p == '/'){
+            *p = 0;
+            mkdir(dir, 0755);
+            *p = '/';
+        }
     }
+}
 
-    /* get a random row from database */
-    char* sql = "SELECT mid, path FROM files ORDER BY RANDOM() LIMIT 1";
+/* copies a file to a new path through a temporary file next to it, durably,
+   computing its checksum on the way. returns 0 if anything fails */
+int copy_to(const char* src, const char* dst, uint32_t* crc){
+    char tmp[512];
+    char data[65536];
+    int n, ok = 1;
+
+    snprintf(tmp, 512, "%s.tmp", dst);
+
+    int in = open(src, O_RDONLY);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(in < 0 || out < 0){
+        perror("Cannot copy file");
+
+        if(in >= 0) close(in);
+        if(out >= 0) close(out);
+        return 0;
+    }
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    *crc = 0;
+
+    while(ok && (n = read(in, data, sizeof(data))) > 0){
+        *crc = smdp_crc32c(*crc, data, n);
+        ok = write(out, data, n) == n;
+    }
+
+    ok = ok && n == 0 && fsync(out) == 0;
+
+    /* the old copy is on its way out, don't let it push anything else
+       out of the page cache */
+    posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+
+    close(in);
+    close(out);
+
+    if(!ok || rename(tmp, dst) < 0){
+        perror("Cannot copy file");
+        unlink(tmp);
+        return 0;
+    }
+
+    return 1;
+}
+
+struct tier_entry {
+    int mid;
+    int tier;
+    int target;
+    uint64_t size;
+    double rank;
+    int64_t digest;
+    char path[256];
+};
+
+int compare_mid(const void* a, const void* b){
+    return ((const struct tier_entry*)a)->mid - ((const struct tier_entry*)b)->mid;
+}
+
+int compare_rank(const void* a, const void* b){
+    double x = ((const struct tier_entry*)a)->rank;
+    double y = ((const struct tier_entry*)b)->rank;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* moves a file to its target tier. the new copy is complete before the
+   path in the files table changes, and the old one is only retired, so
+   transfers that opened it, or looked up its path just before the change,
+   carry on undisturbed. returns 0 if the file stays where it is */
+int migrate_file(struct tier_entry* e){
+    char dst[512];
+    uint32_t crc = 0;
+    int copied = 0;
+
+    snprintf(dst, 512, "%s%s", tiers[e->target].dir, e->path + strlen(tiers[e->tier].dir));
+
+    if(access(dst, F_OK) == 0){
+        fprintf(stderr, "Cannot move %s, %s already exists\n", e->path, dst);
+        return 0;
+    }
+
+    make_parents(dst);
+
+    /* tiers on the same file system only need another link */
+    if(link(e->path, dst) < 0){
+        if(errno != EXDEV || !copy_to(e->path, dst, &crc)){
+            return 0;
+        }
+
+        copied = 1;
+
+        if(e->digest >= 0 && crc != e->digest){
+            fprintf(stderr, "Checksum mismatch copying %s, leaving it\n", e->path);
+            unlink(dst);
+            return 0;
+        }
+    }
+
+    char dir[512];
+    strncpy(dir, dst, 511);
+    dir[511] = 0;
+    *strrchr(dir, '/') = 0;
 
+    int dirfd = open(dir, O_RDONLY);
+    if(dirfd >= 0){
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    /* only if the file hasn't been changed or removed in the meantime */
     sqlite3_stmt* stmt;
-    int rc;
+    int changed = 0;
 
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if(rc != SQLITE_OK){
-        dberror("Failed to execute statement");
+    if(sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK){
+        unlink(dst);
+        return 0;
     }
 
-    rc = sqlite3_step(stmt);
+    sqlite3_prepare_v2(db, "UPDATE files SET path=?, digest=IFNULL(digest, ?) WHERE mid=? AND path=?", -1, &stmt, 0);
+    sqlite3_bind_text(stmt, 1, dst, -1, SQLITE_STATIC);
+
+    if(copied){
+        sqlite3_bind_int64(stmt, 2, crc);
+    } else {
+        sqlite3_bind_null(stmt, 2);
+    }
 
+    sqlite3_bind_int(stmt, 3, e->mid);
+    sqlite3_bind_text(stmt, 4, e->path, -1, SQLITE_STATIC);
 
-    if(rc == SQLITE_ROW){
-        /* found one, send its id and then send the file */
-        int mid = sqlite3_column_int(stmt, 0);
+    if(sqlite3_step(stmt) == SQLITE_DONE){
+        changed = sqlite3_changes(db);
+    }
+
+    sqlite3_finalize(stmt);
+
+    if(changed == 1){
+        sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO retired VALUES(?, ?)", -1, &stmt, 0);
+        sqlite3_bind_text(stmt, 1, e->path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, time(NULL));
+
+        if(sqlite3_step(stmt) != SQLITE_DONE){
+            changed = 0;
+        }
+
+        sqlite3_finalize(stmt);
+    }
+
+    if(changed != 1 || sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        unlink(dst);
+        return 0;
+    }
+
+    stat_add(STAT_MIGRATED_FILES, 1);
+    stat_add(STAT_MIGRATED_BYTES, e->size);
+
+    if(verbose){
+        printf("Moved %s to %s\n", e->path, dst);
+    }
+
+    return 1;
+}
+
+/* removes the old copies of moved files once nobody can be using their paths
+   anymore, unless a file has been moved back there in the meantime */
+void purge_retired(uint32_t now){
+    sqlite3_stmt* stmt;
+
+    sqlite3_prepare_v2(db, "SELECT path FROM retired WHERE at <= ? "
+                           "AND NOT EXISTS (SELECT 1 FROM files WHERE files.path = retired.path)", -1, &stmt, 0);
+    sqlite3_bind_int64(stmt, 1, now - MIGRATE_GRACE);
+
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        const char* path = (const char*)sqlite3_column_text(stmt, 0);
+
+        if(unlink(path) < 0 && errno != ENOENT){
+            fprintf(stderr, "Cannot remove %s\n", path);
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    sqlite3_prepare_v2(db, "DELETE FROM retired WHERE at <= ?", -1, &stmt, 0);
+    sqlite3_bind_int64(stmt, 1, now - MIGRATE_GRACE);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+}
+
+/* ranks the files on the tiers by their request counters and fills the tiers
+   from the fastest down, then moves the files that aren't where they belong,
+   the ones going down first to make room for the ones going up */
+void migrate_round(){
+    uint32_t now = time(NULL);
+    int count = 0, capacity = 1024;
+    struct tier_entry* entries = malloc(capacity * sizeof(struct tier_entry));
+    sqlite3_stmt* stmt;
+    int i, pass;
+
+    purge_retired(now);
+
+    sqlite3_prepare_v2(db, "SELECT mid, path, digest FROM files ORDER BY mid", -1, &stmt, 0);
+
+    while(sqlite3_step(stmt) == SQLITE_ROW){
         const char* path = (const char*)sqlite3_column_text(stmt, 1);
+        struct stat st;
+        int tier;
 
-        printf("%d %s\n", mid, path);
+        if(path == NULL || (tier = tier_of(path)) < 0 || stat(path, &st) < 0){
+            continue;
+        }
 
-        smdp_write_int(sock, mid);
-        send_file(sock, path);
-    } else {
-        /* apparently, there are no rows in the table */
-        fprintf(stderr, "There are no files in the database, really?\n");
-        smdp_write_int(sock, SMDP_NOFILE);
+        if(count == capacity){
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(struct tier_entry));
+        }
+
+        struct tier_entry* e = &entries[count++];
+
+        e->mid = sqlite3_column_int(stmt, 0);
+        e->tier = tier;
+        e->size = st.st_size;
+        e->rank = 0;
+        e->digest = column_digest(stmt, 2);
+        strncpy(e->path, path, 255);
+        e->path[255] = 0;
+    }
+
+    sqlite3_finalize(stmt);
+
+    /* the entries are in mid order, so the counters can be matched up
+       without claiming slots for files that were never requested */
+    for(i=0;i<ACCESS_SLOTS;i++){
+        struct tier_entry key;
+        key.mid = access_table[i].mid;
+
+        struct tier_entry* e = key.mid == 0 ? NULL :
+            bsearch(&key, entries, count, sizeof(struct tier_entry), compare_mid);
+
+        if(e != NULL){
+            e->rank = access_score(&access_table[i], now);
+
+            if(e->tier < tier_count - 1){
+                e->rank *= MIGRATE_STAY_BONUS;
+            }
+        }
+    }
+
+    qsort(entries, count, sizeof(struct tier_entry), compare_rank);
+
+    uint64_t used[MAX_TIERS] = {0};
+
+    for(i=0;i<count;i++){
+        struct tier_entry* e = &entries[i];
+
+        /* files nobody asks for don't take up room on the fast tiers */
+        e->target = tier_count - 1;
+
+        if(e->rank > 0){
+            int t;
+
+            for(t=0;t<tier_count-1;t++){
+                if(used[t] + e->size <= tiers[t].capacity){
+                    e->target = t;
+                    break;
+                }
+            }
+        }
+
+        used[e->target] += e->size;
+    }
+
+    int64_t budget = MIGRATE_MAX_BYTES;
+
+    for(pass=0;pass<2;pass++){
+        for(i=0;i<count && budget > 0;i++){
+            struct tier_entry* e = &entries[i];
+            int down = e->target > e->tier;
+            int up = e->target < e->tier;
+
+            if((pass == 0 && down) || (pass == 1 && up)){
+                if(migrate_file(e)){
+                    budget -= e->size;
+                }
+            }
+        }
+    }
+
+    free(entries);
+}
+
+volatile sig_atomic_t migrator_stopping = 0;
+
+void stop_migrator(int sig){
+    migrator_stopping = 1;
+}
+
+/* the migrator runs a round every once in a while, until the server is gone */
+void run_migrator(){
+    int parent = getppid();
+
+    signal(SIGTERM, stop_migrator);
+    signal(SIGINT, stop_migrator);
+
+    open_db();
+
+    while(!migrator_stopping && getppid() == parent){
+        migrate_round();
+
+        /* sleep is cut short by a signal */
+        sleep(MIGRATE_INTERVAL);
+    }
+
+    sqlite3_close(db);
+}
+
+void start_migrator(){
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        /* the committer stops once every writer of the ingest pipe is gone,
+           which the migrator isn't */
+        close(ingest_fd);
+
+        if(unixfd >= 0){
+            close(unixfd);
+        }
+
+        run_migrator();
+        exit(0);
     }
+
+    migrator_pid = pid;
 }
 
 void do_upload(int sock){
@@ -393,16 +3074,20 @@ void do_upload(int sock){
     if(!authenticated){
         smdp_write_int(sock, SMDP_DENY);
         return;
-    } else {
-        smdp_write_int(sock, SMDP_ACCEPT);
     }
 
+    if(!begin_transfer(sock)){
+        return;
+    }
+
+    smdp_write_int(sock, SMDP_ACCEPT);
+
     char name[256];
-    char filename[256];
+    char filename[16];
     char path[256];
 
     memset(&name, 0, 256);
-    memset(&filename, 0, 256);
+    memset(&filename, 0, 16);
     memset(&path, 0, 256);
     smdp_read_str(sock, name, 256);
 
@@ -410,7 +3095,12 @@ void do_upload(int sock){
         printf("Received name %s\n", name); 
     }
 
+    /* tr is supposed to die of sigpipe once head has its 12 characters,
+       so don't pass our ignored sigpipe on to it */
+    signal(SIGPIPE, SIG_DFL);
     FILE* pipe = popen("< /dev/urandom tr -dc _A-Z-a-z-0-9 | head -c12", "r");
+    signal(SIGPIPE, SIG_IGN);
+
     fread(filename, 1, 12, pipe);
     pclose(pipe);
 
@@ -418,31 +3108,140 @@ void do_upload(int sock){
         printf("Random filename: %s\n", filename);
     }
 
-    snprintf(path, 256, "uploads/%s.mp3", filename);
+    snprintf(path, 256, "%s/%s.mp3", upload_dir, filename);
 
-    receive_file(sock, path);
+    uint32_t digest;
+    struct mp3scan scan;
+    const char* problem = receive_file(sock, path, &digest, &scan);
 
-    char* sql = "INSERT INTO files(name, path) VALUES(?, ?)";
+    if(problem != NULL){
+        stat_add(STAT_REJECTED_UPLOADS, 1);
 
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+        smdp_write_int(sock, SMDP_REJECT);
+        smdp_write_str(sock, (char*)problem);
+        end_transfer();
+        return;
+    }
 
-    sqlite3_bind_text(stmt, 1, name, strlen(name), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, path, strlen(path), SQLITE_STATIC);
+    if(verbose){
+        printf("%s has %u frames, %u ms%s%s\n", path, scan.frames, mp3scan_duration(&scan),
+               scan.vbr ? ", vbr" : "",
+               scan.info == MP3_INFO_XING ? ", xing header" : scan.info == MP3_INFO_VBRI ? ", vbri header" : "");
+    }
 
-    if(rc != SQLITE_OK){
-        dberror("Failed to prepare statement");
+    /* make the new directory entry durable as well */
+    int dirfd = open(upload_dir, O_RDONLY);
+    if(dirfd >= 0){
+        fsync(dirfd);
+        close(dirfd);
     }
 
-    rc = sqlite3_step(stmt);
+    /* hand the file over to the committer, it stays invisible
+       until the batch it ends up in is committed */
+    struct ingest_record rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.name, name, sizeof(rec.name));
+    memcpy(rec.path, path, sizeof(rec.path));
+    rec.digest = digest;
+    rec.duration = mp3scan_duration(&scan);
+    rec.frames = scan.frames;
+
+    if(ingest_fd < 0 || write(ingest_fd, &rec, sizeof(rec)) != sizeof(rec)){
+        /* no committer running, register it ourselves */
+        if(!register_uploads(&rec, 1)){
+            unlink(path);
+
+            smdp_write_int(sock, SMDP_REJECT);
+            smdp_write_str(sock, "cannot register the upload");
+            end_transfer();
+            return;
+        }
+    }
 
-    if(rc == SQLITE_ERROR){
-        dberror("Failed to execute statement");
+    smdp_write_int(sock, SMDP_ACCEPT);
+    end_transfer();
+}
+
+uint64_t monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* starts a new trace file, shared by all sessions. session numbers start
+   over with every run of the server, so an old trace is overwritten */
+void open_capture(){
+    struct trace_header header = {TRACE_MAGIC, TRACE_VERSION};
+
+    capture_fd = open(capture_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    if(capture_fd < 0){
+        error("Cannot open capture file");
+    }
+
+    if(write(capture_fd, &header, sizeof(header)) != sizeof(header)){
+        error("Cannot write capture file");
+    }
+}
+
+/* starts recording a request, before its message type is read */
+void capture_begin(){
+    if(capture_session == 0){
+        capture_session = __sync_add_and_fetch(&stats[STAT_CAPTURED_SESSIONS], 1);
     }
+
+    capture_rec.session = capture_session;
+    capture_rec.start_us = monotonic_us();
+    capture_rec.bytes_in = smdp_bytes_in;
+    capture_rec.bytes_out = smdp_bytes_out;
+
+    smdp_tap = capture_args;
+    smdp_tap_size = sizeof(capture_args);
+    smdp_tap_len = 0;
+}
+
+/* appends the request to the trace. each record goes out in a single write,
+   so records from concurrent sessions don't get mixed up in the file */
+void capture_end(uint32_t msgtype){
+    unsigned char record[sizeof(struct trace_record) + TRACE_ARGS_MAX];
+
+    smdp_tap = NULL;
+
+    capture_rec.type = msgtype;
+    capture_rec.duration_us = monotonic_us() - capture_rec.start_us;
+    capture_rec.bytes_in = smdp_bytes_in - capture_rec.bytes_in;
+    capture_rec.bytes_out = smdp_bytes_out - capture_rec.bytes_out;
+
+    /* the message type was tapped too, the arguments come after it.
+       passwords don't belong in a trace, replay brings its own */
+    capture_rec.arglen = smdp_tap_len - sizeof(uint32_t);
+
+    if(smdp_tap_len < sizeof(uint32_t) || msgtype == SMDP_PASS){
+        capture_rec.arglen = 0;
+    }
+
+    memcpy(record, &capture_rec, sizeof(capture_rec));
+    memcpy(record + sizeof(capture_rec), capture_args + sizeof(uint32_t), capture_rec.arglen);
+
+    size_t len = sizeof(capture_rec) + capture_rec.arglen;
+
+    if(write(capture_fd, record, len) != (ssize_t)len){
+        perror("Cannot write capture file");
+        return;
+    }
+
+    stat_add(STAT_CAPTURED_REQUESTS, 1);
 }
 
 void handle(int sock){
-    open_db();
+    /* pre-forked workers keep their database open between sessions */
+    if(!prefork_worker){
+        open_db();
+    }
+
+    /* the session has started, tell the client so it doesn't have to guess
+       whether it's about to be turned away (see shed_connection) */
+    smdp_write_int(sock, SMDP_ACCEPT);
 
     /* we'll be using select system call for implementing timeout
        fd_set is a bit-set type of data structure for specifying sockets
@@ -483,6 +3282,10 @@ void handle(int sock){
             break;
         }
 
+        if(capture_fd >= 0){
+            capture_begin();
+        }
+
         /* read the message type */
         uint32_t msgtype = smdp_read_int(sock);
 
@@ -507,6 +3310,14 @@ void handle(int sock){
             do_list(sock);
             break;
 
+            case SMDP_SYNC:
+            do_sync(sock);
+            break;
+
+            case SMDP_STATS:
+            do_stats(sock);
+            break;
+
             case SMDP_USER:
             do_user(sock);
             break;
@@ -519,12 +3330,52 @@ void handle(int sock){
             do_file(sock);
             break;
 
-            case SMDP_RANDOM:
-            do_random(sock);
+            case SMDP_FILE_IF:
+            do_file_if(sock);
+            break;
+
+            case SMDP_FILE_FD:
+            do_file_fd(sock);
+            break;
+
+            case SMDP_RANGE:
+            do_range(sock);
+            break;
+
+            case SMDP_SNAPSHOT:
+            do_snapshot(sock);
+            break;
+
+            case SMDP_BUNDLE:
+            do_bundle(sock);
+            break;
+
+            case SMDP_RANDOM:
+            do_random(sock);
+            break;
+
+            case SMDP_UPLOAD:
+            do_upload(sock);
+            break;
+
+            case SMDP_PLAYLIST_CREATE:
+            do_playlist_create(sock);
+            break;
+
+            case SMDP_PLAYLIST_APPEND:
+            do_playlist_append(sock);
+            break;
+
+            case SMDP_PLAYLIST_GET:
+            do_playlist_get(sock);
+            break;
+
+            case SMDP_PLAY:
+            do_play(sock);
             break;
 
-            case SMDP_UPLOAD:
-            do_upload(sock);
+            case SMDP_NEXT:
+            do_next(sock);
             break;
 
             default:
@@ -532,11 +3383,18 @@ void handle(int sock){
             goto _handle_end;
             break;
         }
-    
+
+        if(capture_fd >= 0){
+            capture_end(msgtype);
+        }
     }
 
     _handle_end:
-    sqlite3_close(db);
+    clear_play_queue();
+
+    if(!prefork_worker){
+        sqlite3_close(db);
+    }
 }
 
 void setup(){
@@ -558,6 +3416,16 @@ void setup(){
         error("Error opening socket");
     }
 
+    /* when there are several acceptors, each one binds its own socket
+       to the same port and the kernel balances connections between them */
+    if(acceptors != 1){
+        int one = 1;
+
+        if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0){
+            error("Error setting SO_REUSEPORT");
+        }
+    }
+
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port_no);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -567,23 +3435,58 @@ void setup(){
         error("Error binding socket");
     }
 
-    /* listen for connections with a backlog of 5, 
+    /* listen for connections with a backlog of 5 by default, 
        hopefully that won't fill up since we're using a forking server
        (also hopefully, anon won't be angry at us and won't DDOS us) */
-    listen(listenfd, 5);
+    listen(listenfd, backlog);
 
     if(verbose){
         printf("Listening\n");
     }
 }
 
+/* opens the unix domain socket, shared by all acceptors. it's non-blocking
+   since every acceptor is woken up when a connection arrives on it */
+void setup_unix(){
+    struct sockaddr_un addr;
+
+    if(strlen(unix_path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket path too long: %s\n", unix_path);
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, unix_path);
+
+    unixfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(unixfd < 0){
+        error("Error opening unix socket");
+    }
+
+    /* a socket left behind by an earlier run would make bind fail */
+    unlink(unix_path);
+
+    if(bind(unixfd, (struct sockaddr*) &addr, sizeof(addr)) < 0){
+        error("Error binding unix socket");
+    }
+
+    listen(unixfd, backlog);
+    fcntl(unixfd, F_SETFL, O_NONBLOCK);
+
+    if(verbose){
+        printf("Listening on %s\n", unix_path);
+    }
+}
+
 void parse_opts(int argc, char** argv){
     int c;
 
     for(;;){
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "p:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "p:vb:a:PT:w:s:t:q:r:c:u:f:R:S:E:i:", long_options, &option_index);
 
         if(c == -1) break;
 
@@ -597,25 +3500,213 @@ void parse_opts(int argc, char** argv){
             printf("Verbose mode\n");
             break;
 
+            case 'b':
+            backlog = atoi(optarg);
+            break;
+
+            case 'a':
+            acceptors = atoi(optarg);
+            break;
+
+            case 'P':
+            pin_acceptors = 1;
+            break;
+
+            case 'T':
+            busy_timeout = atoi(optarg);
+            break;
+
+            case 'w':
+            warm_tracks = atoi(optarg);
+            break;
+
+            case 's':
+            max_sessions = atoi(optarg);
+            break;
+
+            case 't':
+            max_transfers = atoi(optarg);
+            break;
+
+            case 'q':
+            queue_len = atoi(optarg);
+            break;
+
+            case 'r':
+            retry_after = atoi(optarg);
+            break;
+
+            case 'c':
+            capture_path = optarg;
+            break;
+
+            case 'u':
+            unix_path = optarg;
+            break;
+
+            case 'f':
+            prefork = atoi(optarg);
+            break;
+
+            case 'R':
+            recycle_after = atoi(optarg);
+            break;
+
+            case 'S':
+            snapshot_file = optarg;
+            break;
+
+            case 'E':
+            export_file = optarg;
+            break;
+
+            case 'i':
+            add_tier(optarg);
+            break;
+
             default:
             abort();
         }
     }
 }
 
-int main(int argc, char** argv){
-    parse_opts(argc, argv);
-    setup();
+/* whether a connection came in through the unix socket */
+int is_local(int fd){
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if(getsockname(fd, (struct sockaddr*) &addr, &addrlen) < 0){
+        return 0;
+    }
+
+    return addr.ss_family == AF_UNIX;
+}
+
+/* forks a process to handle a connection */
+void start_session(int fd){
+    stat_add(STAT_SESSIONS, 1);
+
+    /* map a new snapshot once here rather than in every session, and let go
+       of the old one so its pages can be freed */
+    snapshot_refresh();
+
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        /* child process handling the connection, if it exits in the middle
+           of a transfer the slot is given back on the way out */
+        atexit(end_transfer);
+        close(listenfd);
+
+        if(unixfd >= 0){
+            close(unixfd);
+        }
+
+        local_session = is_local(fd);
+        handle(fd);
+        close(fd);
+        exit(0);
+    } else {
+        /* parent process continuing the loop */
+        close(fd);
+    }
+}
+
+/* tells the client to come back later and hangs up */
+void shed_connection(int fd){
+    stat_add(STAT_SHED_SESSIONS, 1);
+
+    if(verbose){
+        printf("Too many connections, asking client to retry\n");
+    }
+
+    smdp_write_int(fd, SMDP_BUSY);
+    smdp_write_int(fd, retry_after);
+
+    /* read whatever the client sent already, closing a socket with unread
+       data resets the connection and the client might not see the response */
+    shutdown(fd, SHUT_WR);
+    while(recv(fd, buf, 1024, MSG_DONTWAIT) > 0);
+
+    close(fd);
+}
+
+/* collects finished sessions, giving back their slots */
+void reap_sessions(){
+    int pid;
+    int status;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+        if(!restart_committer(pid, status) && pid != migrator_pid){
+            __sync_fetch_and_sub(&stats[STAT_SESSIONS], 1);
+            release_transfer(pid);
+        }
+    }
+}
+
+int session_available(){
+    return max_sessions <= 0 || stats[STAT_SESSIONS] < (uint64_t)max_sessions;
+}
+
+void accept_loop(){
+    /* connections waiting for a session slot, as a ring buffer */
+    int* pending = calloc(queue_len > 0 ? queue_len : 1, sizeof(int));
+    int head = 0, queued = 0;
 
     for(;;){
+        reap_sessions();
+
+        /* start waiting connections as slots free up */
+        while(queued > 0 && session_available()){
+            start_session(pending[head]);
+            head = (head + 1) % queue_len;
+            queued--;
+            __sync_fetch_and_sub(&stats[STAT_QUEUED], 1);
+        }
+
+        /* wait for a connection, waking up every now and then to reap
+           finished sessions (quickly if there are connections waiting) */
+        struct timeval tv;
+        tv.tv_sec = queued > 0 ? 0 : 1;
+        tv.tv_usec = queued > 0 ? 20000 : 0;
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listenfd, &readfds);
+
+        int maxfd = listenfd;
+
+        if(unixfd >= 0){
+            FD_SET(unixfd, &readfds);
+            maxfd = unixfd > maxfd ? unixfd : maxfd;
+        }
+
+        int res = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+
+        if(res < 0 && errno != EINTR){
+            error("select() failed");
+        } else if(res <= 0){
+            continue;
+        }
+
         /* wait until a new connection is made
            last two arguments are null since we don't care about
            the connecting client's address
            (we might want to change that if we add logging support and stuff) */
-        connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+        int fd = (unixfd >= 0 && FD_ISSET(unixfd, &readfds)) ? unixfd : listenfd;
+
+        connfd = accept(fd, (struct sockaddr*)NULL, NULL);
 
 
         if(connfd < 0){
+            if(errno == EINTR || errno == EAGAIN){
+                continue;
+            }
+
             error("Error establishing connection");
         }
 
@@ -623,23 +3714,367 @@ int main(int argc, char** argv){
             printf("Accepting new connection\n");
         }
 
-        int pid = fork();
+        reap_sessions();
+
+        if(queued == 0 && session_available()){
+            start_session(connfd);
+        } else if(queued < queue_len){
+            pending[(head + queued) % queue_len] = connfd;
+            queued++;
+            stat_add(STAT_QUEUED, 1);
+        } else {
+            shed_connection(connfd);
+        }
+    }
+}
+
+/* forks an acceptor process with its own listening socket */
+int spawn_acceptor(int index){
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        if(pin_acceptors){
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &set);
+
+            if(sched_setaffinity(0, sizeof(set), &set) < 0){
+                perror("Error pinning acceptor");
+            }
+        }
+
+        setup();
+        accept_loop();
+        exit(0);
+    }
+
+    return pid;
+}
+
+/* starts the acceptors and restarts any of them that dies */
+void run_acceptors(){
+    if(acceptors <= 0){
+        acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(verbose){
+        printf("Starting %d acceptors\n", acceptors);
+    }
+
+    int* pids = calloc(acceptors, sizeof(int));
+    int i;
+
+    for(i=0;i<acceptors;i++){
+        pids[i] = spawn_acceptor(i);
+    }
+
+    for(;;){
+        int status;
+        int pid = waitpid(-1, &status, 0);
 
         if(pid < 0){
-            error("Error on fork");
+            if(errno == EINTR){
+                continue;
+            }
+
+            error("Error waiting for acceptors");
         }
 
-        if(pid == 0){
-            /* child process handling the connection */
-            close(listenfd);
-            handle(connfd);
-            close(connfd);
-            return 0;
-        } else {
-            /* parent process continuing the loop */
-            close(connfd);
+        if(restart_committer(pid, status)){
+            continue;
+        }
+
+        /* connection handlers are children of the acceptors, so any
+           other child we see here is an acceptor */
+        for(i=0;i<acceptors;i++){
+            if(pids[i] == pid){
+                fprintf(stderr, "Acceptor %d exited, restarting\n", i);
+
+                /* don't spin if it keeps failing, e.g. when the port is taken */
+                sleep(1);
+                pids[i] = spawn_acceptor(i);
+            }
+        }
+    }
+}
+
+/* forgets everything about the last session, for workers
+   that handle one session after the other */
+void reset_session(){
+    end_transfer();
+
+    authenticated = 0;
+    memset(username, 0, sizeof(username));
+    memset(password, 0, sizeof(password));
+
+    local_session = 0;
+    capture_session = 0;
+}
+
+/* gives back the session slot of a worker, also when it exits mid-session */
+void leave_session(){
+    if(in_session){
+        worker_sessions[worker_index] = 0;
+        __sync_fetch_and_sub(&stats[STAT_SESSIONS], 1);
+        in_session = 0;
+    }
+}
+
+/* a pre-forked worker: accepts connections on the shared sockets and handles
+   them itself, one at a time, until it's time to make room for a fresh one */
+void worker_loop(){
+    int sessions = 0;
+
+    prefork_worker = 1;
+    atexit(end_transfer);
+    atexit(leave_session);
+
+    /* everything a session needs is ready before the first connection,
+       including the schema (which sqlite only reads on the first statement)
+       and the statements of the most common lookups */
+    open_db();
+    prepare_cached(&lookup_stmt, LOOKUP_SQL);
+    prepare_cached(&user_stmt, USER_SQL);
+    prepare_cached(&count_stmt, COUNT_SQL);
+
+    while(recycle_after <= 0 || sessions < recycle_after){
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listenfd, &readfds);
+
+        int maxfd = listenfd;
+
+        if(unixfd >= 0){
+            FD_SET(unixfd, &readfds);
+            maxfd = unixfd > maxfd ? unixfd : maxfd;
+        }
+
+        if(select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+
+            error("select() failed");
+        }
+
+        int fd = (unixfd >= 0 && FD_ISSET(unixfd, &readfds)) ? unixfd : listenfd;
+
+        /* every idle worker wakes up, the ones that lose the race get EAGAIN */
+        connfd = accept(fd, (struct sockaddr*)NULL, NULL);
+
+        if(connfd < 0){
+            if(errno == EINTR || errno == EAGAIN){
+                continue;
+            }
+
+            error("Error establishing connection");
+        }
+
+        if(verbose){
+            printf("Accepting new connection\n");
+        }
+
+        /* the same limit on sessions as when forking for each one */
+        if(!session_available()){
+            shed_connection(connfd);
+            continue;
+        }
+
+        stat_add(STAT_SESSIONS, 1);
+        in_session = 1;
+        worker_sessions[worker_index] = 1;
+
+        local_session = is_local(connfd);
+        handle(connfd);
+        close(connfd);
+
+        leave_session();
+
+        reset_session();
+        sessions++;
+    }
+
+    finalize_cached();
+    sqlite3_close(db);
+}
+
+int spawn_worker(int index){
+    int pid = fork();
+
+    if(pid < 0){
+        error("Error on fork");
+    }
+
+    if(pid == 0){
+        worker_index = index;
+        worker_loop();
+        exit(0);
+    }
+
+    return pid;
+}
+
+/* starts the pre-forked workers on a shared listening socket,
+   and replaces the ones that are recycled or crash. while every worker is
+   busy nobody would pick up a new connection until one is done, so those
+   are turned away right here, like accept_loop does when it's full */
+void run_workers(){
+    setup();
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+
+    if(verbose){
+        printf("Starting %d workers\n", prefork);
+    }
+
+    worker_sessions = mmap(NULL, prefork * sizeof(int), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(worker_sessions == MAP_FAILED){
+        error("Error mapping worker states");
+    }
+
+    int* pids = calloc(prefork, sizeof(int));
+    int i;
+
+    for(i=0;i<prefork;i++){
+        pids[i] = spawn_worker(i);
+    }
+
+    for(;;){
+        int status;
+        int pid;
+
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+            if(restart_committer(pid, status)){
+                continue;
+            }
+
+            for(i=0;i<prefork;i++){
+                if(pids[i] != pid){
+                    continue;
+                }
+
+                /* whatever it didn't give back itself */
+                if(worker_sessions[i]){
+                    worker_sessions[i] = 0;
+                    __sync_fetch_and_sub(&stats[STAT_SESSIONS], 1);
+                }
+
+                release_transfer(pid);
+
+                if(WIFEXITED(status) && WEXITSTATUS(status) == 0){
+                    if(verbose){
+                        printf("Worker %d recycled\n", i);
+                    }
+                } else {
+                    fprintf(stderr, "Worker %d exited, restarting\n", i);
+                }
+
+                pids[i] = spawn_worker(i);
+            }
+        }
+
+        int busy = 0;
+
+        for(i=0;i<prefork;i++){
+            busy += worker_sessions[i];
+        }
+
+        /* only watch for connections while there's no worker to take them,
+           otherwise just wake up now and then to look after the workers */
+        fd_set readfds;
+        FD_ZERO(&readfds);
+
+        int maxfd = -1;
+
+        if(busy == prefork){
+            FD_SET(listenfd, &readfds);
+            maxfd = listenfd;
+
+            if(unixfd >= 0){
+                FD_SET(unixfd, &readfds);
+                maxfd = unixfd > maxfd ? unixfd : maxfd;
+            }
+        }
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = SUPERVISOR_TICK_MS * 1000;
+
+        int res = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+
+        if(res < 0 && errno != EINTR){
+            error("select() failed");
+        } else if(res <= 0){
+            continue;
+        }
+
+        int fd = (unixfd >= 0 && FD_ISSET(unixfd, &readfds)) ? unixfd : listenfd;
+
+        /* a worker that has just finished may have taken it already */
+        connfd = accept(fd, (struct sockaddr*)NULL, NULL);
+
+        if(connfd >= 0){
+            shed_connection(connfd);
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    parse_opts(argc, argv);
+    stats_init();
+    access_init();
+    init_db();
+
+    if(export_file != NULL){
+        open_db();
+        int ok = export_snapshot(export_file);
+        sqlite3_close(db);
+        return !ok;
+    }
+
+    check_tiers();
+
+    /* mapped here so every process forked from now on shares it */
+    if(snapshot_file != NULL){
+        open_db();
+        export_snapshot(snapshot_file);
+        sqlite3_close(db);
+
+        if(!snapshot_refresh()){
+            error("Cannot map snapshot");
         }
     }
+
+    if(capture_path != NULL){
+        open_capture();
+    }
+
+    if(unix_path != NULL){
+        setup_unix();
+    }
+
+    /* a dead committer shows up as a failed write to the ingest pipe
+       rather than killing the process writing to it */
+    signal(SIGPIPE, SIG_IGN);
+    start_committer();
+
+    if(tier_count > 1){
+        start_migrator();
+    }
+
+    if(prefork > 0){
+        run_workers();
+    } else if(acceptors == 1){
+        setup();
+        accept_loop();
+    } else {
+        run_acceptors();
+    }
     
     return 0;
 }
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 /* respond with the same message
    for testing purposes */
@@ -19,7 +23,9 @@
 
 #define SMDP_PASS 3
 
-/* authentication accepted */
+/* authentication accepted
+   also sent by the server as soon as a session starts, a connection
+   it turns away gets busy (and how long to wait) instead */
 #define SMDP_ACCEPT 4
 
 /* authentication denied */
@@ -46,19 +52,135 @@
    to indicate a closed connection */
 #define SMDP_CLOSE 11
 
+/* request file only if it differs from
+   the given size and mtime (client cache) */
+#define SMDP_FILE_IF 12
+
+/* cached copy is still valid */
+#define SMDP_NOT_MODIFIED 13
+
+/* request catalog changes since a version
+   or respond with the new version and changed rows */
+#define SMDP_SYNC 14
+
+/* a row removed since the client's version */
+#define SMDP_REMOVED 15
+
+/* request server statistics
+   or respond with a number of (name, value) rows */
+#define SMDP_STATS 16
+
+/* request several files by id in one go
+   or respond with a stream of (mid, file) entries */
+#define SMDP_BUNDLE 17
+
+/* maximum number of files in a bundle */
+#define SMDP_BUNDLE_MAX 256
+
+/* create a playlist with the given name
+   responded with accept and the playlist id */
+#define SMDP_PLAYLIST_CREATE 18
+
+/* append a file to the end of a playlist */
+#define SMDP_PLAYLIST_APPEND 19
+
+/* request the files in a playlist
+   responded like a list request */
+#define SMDP_PLAYLIST_GET 20
+
+/* start playing a playlist, the tracks
+   are then fetched one by one with next */
+#define SMDP_PLAY 21
+
+/* request the next track of the playlist being played
+   or respond with it, along with the header of the track after it */
+#define SMDP_NEXT 22
+
+/* upload refused, followed by the reason */
+#define SMDP_REJECT 23
+
+/* server overloaded, followed by the number
+   of milliseconds to wait before trying again */
+#define SMDP_BUSY 24
+
+/* request a file as an open file descriptor (unix socket only)
+   or respond with the descriptor attached, followed by the size and checksum */
+#define SMDP_FILE_FD 25
+
+/* request part of a file by media id, offset and length
+   responded with file, the size of the whole file
+   and then the part like a file (length, contents and its own checksum) */
+#define SMDP_RANGE 26
+
+/* request the catalog snapshot (see snapshot.h)
+   responded with file, followed by the snapshot like a file
+   (length, contents and checksum) or nofile if the server has none */
+#define SMDP_SNAPSHOT 27
+
 void error(char* msg){
     perror(msg);
     exit(1);
 }
 
+/* when set, a connection that fails or gets closed in the middle of a read
+   or write jumps here instead of exiting, so the caller can carry on
+   with another connection */
+jmp_buf* smdp_recover = NULL;
+
+void smdp_fail(char* msg){
+    if(smdp_recover != NULL){
+        perror(msg);
+        longjmp(*smdp_recover, 1);
+    }
+
+    error(msg);
+}
+
+/* the other side closed the connection, only a problem if we can recover */
+void smdp_closed(){
+    if(smdp_recover != NULL){
+        longjmp(*smdp_recover, 1);
+    }
+}
+
+/* bytes moved through the smdp_* functions, code that reads or writes
+   the socket directly adds to these itself */
+uint64_t smdp_bytes_in = 0;
+uint64_t smdp_bytes_out = 0;
+
+/* when smdp_tap is set, everything read by smdp_read_int and smdp_read_str
+   is also copied into it, up to smdp_tap_size bytes. used by the server
+   to capture the arguments of requests */
+unsigned char* smdp_tap = NULL;
+size_t smdp_tap_size = 0;
+size_t smdp_tap_len = 0;
+
+void smdp_tap_data(const void* data, int n){
+    if(smdp_tap == NULL || n <= 0){
+        return;
+    }
+
+    if((size_t)n > smdp_tap_size - smdp_tap_len){
+        n = smdp_tap_size - smdp_tap_len;
+    }
+
+    memcpy(smdp_tap + smdp_tap_len, data, n);
+    smdp_tap_len += n;
+}
+
 uint32_t smdp_read_int(int sock){
     uint32_t tmp;
     int n = read(sock, &tmp, sizeof(tmp));
 
     if(n < 0){
-        error("Error reading from socket");
+        smdp_fail("Error reading from socket");
+    } else if(n == 0){
+        smdp_closed();
     }
 
+    smdp_bytes_in += n;
+    smdp_tap_data(&tmp, n);
+
     return tmp;
 }
 
@@ -73,29 +195,200 @@ int smdp_read_str(int sock, char* buf, int buflen){
     buf[len] = 0;
 
     if(n < 0){
-        error("Error reading from socket");
+        smdp_fail("Error reading from socket");
     }
 
+    smdp_bytes_in += n;
+    smdp_tap_data(buf, n);
+
     return n;
 }
 
 void smdp_write_int(int sock, uint32_t type){
     int n = write(sock, &type, sizeof(type));
     if(n < 0){
-        error("Error writing to socket");
+        smdp_fail("Error writing to socket");
     }
+
+    smdp_bytes_out += n;
 }
 
 void smdp_write_str(int sock, char* str){
     uint32_t len = strlen(str);
     int n = write(sock, &len, sizeof(len));
     if(n < 0){
-        error("Error writing to socket");
+        smdp_fail("Error writing to socket");
     }
     write(sock, str, len);
     if(n < 0){
-        error("Error writing to socket");
+        smdp_fail("Error writing to socket");
+    }
+
+    smdp_bytes_out += sizeof(len) + len;
+}
+
+/* writes a message type with a file descriptor attached to it,
+   the receiving process gets its own descriptor for the same open file.
+   only works over unix domain sockets */
+void smdp_write_fd(int sock, uint32_t type, int fd){
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = &type;
+    iov.iov_len = sizeof(type);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if(sendmsg(sock, &msg, 0) < 0){
+        smdp_fail("Error writing to socket");
     }
+
+    smdp_bytes_out += sizeof(type);
+}
+
+/* reads a message type, along with the file descriptor attached to it
+   if there is one (otherwise fd is set to -1) */
+uint32_t smdp_read_fd(int sock, int* fd){
+    struct msghdr msg;
+    struct iovec iov;
+    uint32_t type = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = &type;
+    iov.iov_len = sizeof(type);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int n = recvmsg(sock, &msg, 0);
+
+    if(n < 0){
+        smdp_fail("Error reading from socket");
+    }
+
+    smdp_bytes_in += n;
+
+    *fd = -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return type;
+}
+
+/* every file transfer is followed by the crc32c (castagnoli) checksum of
+   the file, computed in the same incremental style as zlib's crc32:
+   start with 0 and feed it the data piece by piece */
+
+uint32_t smdp_crc32c_table[8][256];
+int smdp_crc32c_ready = 0;
+
+void smdp_crc32c_init(){
+    uint32_t i, j;
+
+    for(i=0;i<256;i++){
+        uint32_t crc = i;
+
+        for(j=0;j<8;j++){
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+
+        smdp_crc32c_table[0][i] = crc;
+    }
+
+    /* tables for processing eight bytes at a time */
+    for(i=0;i<256;i++){
+        for(j=1;j<8;j++){
+            uint32_t prev = smdp_crc32c_table[j-1][i];
+            smdp_crc32c_table[j][i] = (prev >> 8) ^ smdp_crc32c_table[0][prev & 0xFF];
+        }
+    }
+
+    smdp_crc32c_ready = 1;
+}
+
+uint32_t smdp_crc32c_sw(uint32_t crc, const unsigned char* p, size_t len){
+    if(!smdp_crc32c_ready){
+        smdp_crc32c_init();
+    }
+
+    while(len >= 8){
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+
+        crc = smdp_crc32c_table[7][lo & 0xFF] ^ smdp_crc32c_table[6][(lo >> 8) & 0xFF] ^
+              smdp_crc32c_table[5][(lo >> 16) & 0xFF] ^ smdp_crc32c_table[4][lo >> 24] ^
+              smdp_crc32c_table[3][hi & 0xFF] ^ smdp_crc32c_table[2][(hi >> 8) & 0xFF] ^
+              smdp_crc32c_table[1][(hi >> 16) & 0xFF] ^ smdp_crc32c_table[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while(len--){
+        crc = (crc >> 8) ^ smdp_crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* the crc32 instruction of sse4.2 computes exactly this checksum,
+   eight bytes per instruction. it's only used if the cpu has it */
+__attribute__((target("sse4.2")))
+uint32_t smdp_crc32c_hw(uint32_t crc, const unsigned char* p, size_t len){
+    uint64_t crc64 = crc;
+
+    while(len >= 8){
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+
+    while(len--){
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+
+    return crc;
+}
+#endif
+
+uint32_t smdp_crc32c(uint32_t crc, const void* data, size_t len){
+    crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if(__builtin_cpu_supports("sse4.2")){
+        return ~smdp_crc32c_hw(crc, data, len);
+    }
+#endif
+
+    return ~smdp_crc32c_sw(crc, data, len);
 }
 
 #endif
@@ -0,0 +1,217 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* catalog snapshots: the files table exported into a single read-only file
+   that is used through mmap, by the server to answer listings and lookups
+   without sql, and by clients to browse the catalog offline.
+
+   the file starts with a header, followed by one array (column) per field,
+   each holding one uint32_t per file, in the order of the media ids.
+   strings are stored nul-terminated in a string area and the name and path
+   columns hold their offsets into it. the by_name column lists the rows
+   in the order of their names, for prefix searches.
+   like the protocol, everything is in host byte order */
+
+#define SNAPSHOT_MAGIC 0x50534d53
+#define SNAPSHOT_VERSION 1
+
+/* bits of the flags column */
+#define SNAPSHOT_HAS_DIGEST 1
+#define SNAPSHOT_MISSING 2
+
+/* the columns, in the order of their offsets in the header */
+#define SNAPSHOT_COLUMN_MIDS 0
+#define SNAPSHOT_COLUMN_NAMES 1
+#define SNAPSHOT_COLUMN_PATHS 2
+#define SNAPSHOT_COLUMN_SIZES 3
+#define SNAPSHOT_COLUMN_MTIMES 4
+#define SNAPSHOT_COLUMN_DIGESTS 5
+#define SNAPSHOT_COLUMN_FLAGS 6
+#define SNAPSHOT_COLUMN_BY_NAME 7
+#define SNAPSHOT_COLUMNS 8
+
+struct snapshot_header{
+    uint32_t magic;
+    uint32_t version;
+
+    /* version of the catalog change log the snapshot was taken at */
+    uint32_t catalog_version;
+    uint32_t count;
+
+    /* offsets of the columns and the string area from the start of the file */
+    uint32_t mids;
+    uint32_t names;
+    uint32_t paths;
+    uint32_t sizes;
+    uint32_t mtimes;
+    uint32_t digests;
+    uint32_t flags;
+    uint32_t by_name;
+    uint32_t strings;
+    uint32_t strings_len;
+};
+
+struct snapshot{
+    unsigned char* base;
+    size_t size;
+    ino_t ino;
+
+    const struct snapshot_header* header;
+    const uint32_t* mids;
+    const uint32_t* names;
+    const uint32_t* paths;
+    const uint32_t* sizes;
+    const uint32_t* mtimes;
+    const uint32_t* digests;
+    const uint32_t* flags;
+    const uint32_t* by_name;
+    const char* strings;
+};
+
+/* checks that a column of count entries lies within the file */
+int snapshot_column_ok(size_t size, uint32_t offset, uint32_t count){
+    return offset % sizeof(uint32_t) == 0 && offset <= size &&
+           (size - offset) / sizeof(uint32_t) >= count;
+}
+
+void snapshot_close(struct snapshot* snap){
+    if(snap->base != NULL){
+        munmap(snap->base, snap->size);
+    }
+
+    memset(snap, 0, sizeof(struct snapshot));
+}
+
+/* maps a snapshot and checks its header and columns, and with check_rows
+   also every row, which takes a pass over the whole file. returns 0 if
+   it can't be opened or is damaged */
+int snapshot_map(struct snapshot* snap, const char* path, int check_rows){
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(snap, 0, sizeof(struct snapshot));
+
+    if(fd < 0){
+        return 0;
+    }
+
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snapshot_header)){
+        close(fd);
+        return 0;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED){
+        return 0;
+    }
+
+    snap->base = base;
+    snap->size = st.st_size;
+    snap->ino = st.st_ino;
+    snap->header = base;
+
+    const struct snapshot_header* h = snap->header;
+    uint32_t i;
+
+    if(h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+       !snapshot_column_ok(snap->size, h->mids, h->count) ||
+       !snapshot_column_ok(snap->size, h->names, h->count) ||
+       !snapshot_column_ok(snap->size, h->paths, h->count) ||
+       !snapshot_column_ok(snap->size, h->sizes, h->count) ||
+       !snapshot_column_ok(snap->size, h->mtimes, h->count) ||
+       !snapshot_column_ok(snap->size, h->digests, h->count) ||
+       !snapshot_column_ok(snap->size, h->flags, h->count) ||
+       !snapshot_column_ok(snap->size, h->by_name, h->count) ||
+       h->strings > snap->size || h->strings_len == 0 ||
+       snap->size - h->strings < h->strings_len){
+        snapshot_close(snap);
+        return 0;
+    }
+
+    snap->mids = (const uint32_t*)(snap->base + h->mids);
+    snap->names = (const uint32_t*)(snap->base + h->names);
+    snap->paths = (const uint32_t*)(snap->base + h->paths);
+    snap->sizes = (const uint32_t*)(snap->base + h->sizes);
+    snap->mtimes = (const uint32_t*)(snap->base + h->mtimes);
+    snap->digests = (const uint32_t*)(snap->base + h->digests);
+    snap->flags = (const uint32_t*)(snap->base + h->flags);
+    snap->by_name = (const uint32_t*)(snap->base + h->by_name);
+    snap->strings = (const char*)(snap->base + h->strings);
+
+    /* every string has to end inside the string area */
+    if(snap->strings[h->strings_len - 1] != 0){
+        snapshot_close(snap);
+        return 0;
+    }
+
+    for(i=0;check_rows && i<h->count;i++){
+        if(snap->names[i] >= h->strings_len || snap->paths[i] >= h->strings_len ||
+           snap->by_name[i] >= h->count){
+            snapshot_close(snap);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* maps a snapshot from somewhere else and checks it can be used safely */
+int snapshot_open(struct snapshot* snap, const char* path){
+    return snapshot_map(snap, path, 1);
+}
+
+const char* snapshot_name(const struct snapshot* snap, uint32_t row){
+    return snap->strings + snap->names[row];
+}
+
+const char* snapshot_path(const struct snapshot* snap, uint32_t row){
+    return snap->strings + snap->paths[row];
+}
+
+/* finds the row of a media id, or returns -1 */
+int snapshot_find(const struct snapshot* snap, uint32_t mid){
+    int lo = 0, hi = (int)snap->header->count - 1;
+
+    while(lo <= hi){
+        int mid_row = lo + (hi - lo) / 2;
+
+        if(snap->mids[mid_row] == mid){
+            return mid_row;
+        } else if(snap->mids[mid_row] < mid){
+            lo = mid_row + 1;
+        } else {
+            hi = mid_row - 1;
+        }
+    }
+
+    return -1;
+}
+
+/* finds the first position in name order whose name isn't less than prefix,
+   the names starting with prefix (if any) follow from there on */
+uint32_t snapshot_find_name(const struct snapshot* snap, const char* prefix){
+    uint32_t lo = 0, hi = snap->header->count;
+
+    while(lo < hi){
+        uint32_t pos = lo + (hi - lo) / 2;
+
+        if(strcmp(snapshot_name(snap, snap->by_name[pos]), prefix) < 0){
+            lo = pos + 1;
+        } else {
+            hi = pos;
+        }
+    }
+
+    return lo;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* session traces, written by the server when started with --capture
+   and read back by the replay tool.
+
+   a trace starts with a header, followed by a record for each request
+   the server handled. every record is followed by the arguments of the
+   request as the client sent them (everything read after the message type),
+   except for uploaded file data, which is never kept, and passwords.
+   like the protocol itself, everything is in host byte order */
+
+#define TRACE_MAGIC 0x52544d53
+#define TRACE_VERSION 1
+
+/* longest argument data kept for a request,
+   enough for a full bundle request */
+#define TRACE_ARGS_MAX 2048
+
+struct trace_header{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct trace_record{
+    /* sessions are numbered in the order they made their first request */
+    uint32_t session;
+
+    /* message type of the request */
+    uint32_t type;
+
+    /* when the request arrived (CLOCK_MONOTONIC) and how long it took,
+       in microseconds */
+    uint64_t start_us;
+    uint32_t duration_us;
+
+    /* length of the argument data following the record */
+    uint32_t arglen;
+
+    /* bytes read and written while handling the request,
+       including the message type and file data */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+#endif